@@ -0,0 +1,234 @@
+/**
+ * XHD Benchmark Injector
+ *
+ * Injects key presses through XTest and times how long xhd takes to run
+ * the marker command bound to the key, which writes one byte to a FIFO.
+ *
+ * inject -f FIFO -w TIMEOUT_MS    Press until the first marker arrives,
+ *                                 prints {"ready_ms": ...}
+ * inject -f FIFO -n N -r RATE     Press N times at RATE per second (0 for
+ *                                 back to back), prints the latency as JSON
+ *
+ * -k KEYSYM selects the key, 0xffc9 (F12) by default.
+ */
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define INJECT_TIMEOUT_MS 1000
+
+xcb_connection_t* conn = NULL;
+xcb_window_t      root;
+
+static
+uint64_t inject_now_ns ( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static
+int inject_compare ( const void* a, const void* b )
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return ( x > y ) - ( x < y );
+}
+
+/**
+ * Inject Find Keycode Function
+ *
+ * Returns the first keycode with keysym on its first level, or 0
+ */
+xcb_keycode_t inject_find_keycode ( uint32_t keysym )
+{
+	const xcb_setup_t* setup = xcb_get_setup( conn );
+	xcb_keycode_t      found = 0;
+	int                i;
+
+	xcb_get_keyboard_mapping_reply_t* reply = xcb_get_keyboard_mapping_reply( conn,
+		xcb_get_keyboard_mapping( conn, setup->min_keycode, setup->max_keycode - setup->min_keycode + 1 ), NULL );
+
+	if ( reply == NULL )
+		return 0;
+
+	xcb_keysym_t* keysyms = xcb_get_keyboard_mapping_keysyms( reply );
+
+	for ( i = 0; i <= setup->max_keycode - setup->min_keycode; ++i )
+	{
+		if ( keysyms[ i * reply->keysyms_per_keycode ] == keysym )
+		{
+			found = setup->min_keycode + i;
+			break;
+		}
+	}
+
+	free( reply );
+	return found;
+}
+
+/**
+ * Inject Press Function
+ *
+ * Presses and releases a key, then waits for the marker
+ * Returns the nanoseconds until the marker, or 0 on timeout
+ */
+uint64_t inject_press ( xcb_keycode_t keycode, int fifo, int timeout_ms )
+{
+	char buf[ 64 ];
+	struct pollfd pfd = { fifo, POLLIN, 0 };
+
+	uint64_t start = inject_now_ns();
+
+	xcb_test_fake_input( conn, XCB_KEY_PRESS, keycode, XCB_CURRENT_TIME, root, 0, 0, 0 );
+	xcb_test_fake_input( conn, XCB_KEY_RELEASE, keycode, XCB_CURRENT_TIME, root, 0, 0, 0 );
+	xcb_flush( conn );
+
+	if ( poll( &pfd, 1, timeout_ms ) <= 0 )
+		return 0;
+
+	uint64_t elapsed = inject_now_ns() - start;
+
+	// One marker per press, but drain anything late
+	while ( read( fifo, buf, sizeof(buf) ) > 0 );
+
+	return elapsed ? elapsed : 1;
+}
+
+int main ( int argc, char** argv )
+{
+	const char* fifo_path = NULL;
+	uint32_t    keysym    = 0xffc9;
+	uint32_t    presses   = 1000;
+	uint32_t    rate      = 0;
+	int         wait_ms   = -1;
+	int         opt;
+	uint32_t    i;
+
+	while ( ( opt = getopt( argc, argv, "f:k:n:r:w:" ) ) != -1 )
+	{
+		switch ( opt )
+		{
+			case 'f':
+				fifo_path = optarg;
+				break;
+			case 'k':
+				keysym = strtoul( optarg, NULL, 0 );
+				break;
+			case 'n':
+				presses = strtoul( optarg, NULL, 0 );
+				break;
+			case 'r':
+				rate = strtoul( optarg, NULL, 0 );
+				break;
+			case 'w':
+				wait_ms = atoi( optarg );
+				break;
+			default:
+				fprintf( stderr, "Usage: %s -f FIFO [-k keysym] [-w timeout_ms | -n presses -r rate]\n", argv[0] );
+				return 1;
+		}
+	}
+
+	if ( fifo_path == NULL || presses == 0 )
+		return 1;
+
+	// Read and write, so the FIFO never reports end-of-file between markers
+	int fifo = open( fifo_path, O_RDWR | O_NONBLOCK );
+
+	if ( fifo < 0 )
+	{
+		fprintf( stderr, "Cannot open %s: %s\n", fifo_path, strerror( errno ) );
+		return 1;
+	}
+
+	conn = xcb_connect( NULL, NULL );
+
+	if ( xcb_connection_has_error( conn ) )
+	{
+		fprintf( stderr, "Cannot connect to the X server\n" );
+		return 1;
+	}
+
+	root = xcb_setup_roots_iterator( xcb_get_setup( conn ) ).data->root;
+
+	xcb_keycode_t keycode = inject_find_keycode( keysym );
+
+	if ( keycode == 0 )
+	{
+		fprintf( stderr, "No key produces keysym 0x%x\n", keysym );
+		return 1;
+	}
+
+	// Startup: press until xhd has grabbed the key and runs the marker
+	if ( wait_ms >= 0 )
+	{
+		uint64_t start = inject_now_ns();
+
+		while ( inject_now_ns() - start < (uint64_t) wait_ms * 1000000 )
+		{
+			if ( inject_press( keycode, fifo, 10 ) )
+			{
+				printf( "{\"ready_ms\": %.3f}\n", ( inject_now_ns() - start ) / 1e6 );
+				return 0;
+			}
+		}
+
+		fprintf( stderr, "xhd did not respond within %d ms\n", wait_ms );
+		return 1;
+	}
+
+	uint64_t* samples  = (uint64_t*) malloc( sizeof(uint64_t) * presses );
+	uint32_t  received = 0;
+	uint64_t  interval = rate ? 1000000000ull / rate : 0;
+	uint64_t  next     = inject_now_ns();
+	uint64_t  sum      = 0;
+
+	if ( samples == NULL )
+		return 1;
+
+	for ( i = 0; i < presses; ++i )
+	{
+		if ( interval )
+		{
+			struct timespec ts = { (time_t) ( next / 1000000000ull ), (long) ( next % 1000000000ull ) };
+			clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+			next += interval;
+		}
+
+		uint64_t elapsed = inject_press( keycode, fifo, INJECT_TIMEOUT_MS );
+
+		if ( elapsed )
+		{
+			samples[ received++ ] = elapsed;
+			sum += elapsed;
+		}
+	}
+
+	qsort( samples, received, sizeof(uint64_t), inject_compare );
+
+	#define INJECT_QUANTILE( q ) ( received ? samples[ (uint32_t) ( ( q ) * ( received - 1 ) ) ] / 1e3 : 0.0 )
+
+	printf( "{\"presses\": %u, \"rate\": %u, \"lost\": %u, \"latency_us\": "
+	        "{\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+	        presses, rate, presses - received,
+	        INJECT_QUANTILE( 0.0 ), received ? sum / 1e3 / received : 0.0,
+	        INJECT_QUANTILE( 0.5 ), INJECT_QUANTILE( 0.9 ), INJECT_QUANTILE( 0.99 ), INJECT_QUANTILE( 1.0 ) );
+
+	#undef INJECT_QUANTILE
+
+	free( samples );
+	close( fifo );
+	xcb_disconnect( conn );
+	return 0;
+}
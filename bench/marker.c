@@ -0,0 +1,22 @@
+/**
+ * XHD Benchmark Marker
+ *
+ * Bound to the benchmark key: writes one byte to the FIFO the injector
+ * waits on. It has no dependencies, so it starts as fast as a program can.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+
+int main ( int argc, char** argv )
+{
+	if ( argc < 2 )
+		return 1;
+
+	int fd = open( argv[1], O_WRONLY | O_NONBLOCK );
+
+	if ( fd < 0 || write( fd, "x", 1 ) != 1 )
+		return 1;
+
+	close( fd );
+	return 0;
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+# XHD end-to-end benchmark
+#
+# Starts Xvfb, generates a config, starts xhd on it and injects key presses
+# through XTest, timing each until the bound marker command has run.
+# Prints one JSON object with startup, grab, latency and memory results.
+#
+# Knobs, from the environment:
+#   BENCH_MODES     modes in the generated config          (4)
+#   BENCH_BINDINGS  bindings per mode, at most 360         (200)
+#   BENCH_PRESSES   key presses to inject                  (1000)
+#   BENCH_RATE      presses per second, 0 for back to back (100)
+#   BENCH_COMPILE   1 to start from a compiled cache       (0)
+#   BENCH_EXECUTOR  1 to run xhd with -e                   (0)
+#   BENCH_DISPLAY   display for Xvfb                       (:99)
+#   BENCH_OUT       also write the results to this file
+
+set -e
+
+MODES=${BENCH_MODES:-4}
+BINDINGS=${BENCH_BINDINGS:-200}
+PRESSES=${BENCH_PRESSES:-1000}
+RATE=${BENCH_RATE:-100}
+COMPILE=${BENCH_COMPILE:-0}
+EXECUTOR=${BENCH_EXECUTOR:-0}
+DISPLAY=${BENCH_DISPLAY:-:99}
+export DISPLAY
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+XVFB_PID=
+XHD_PID=
+
+cleanup ()
+{
+	[ -n "$XHD_PID" ] && kill "$XHD_PID" 2>/dev/null || true
+	[ -n "$XVFB_PID" ] && kill "$XVFB_PID" 2>/dev/null || true
+	rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# Display
+Xvfb "$DISPLAY" -nolisten tcp -noreset >"$TMP/xvfb.log" 2>&1 &
+XVFB_PID=$!
+
+SOCKET=/tmp/.X11-unix/X${DISPLAY#:}
+TRIES=0
+while [ ! -S "$SOCKET" ]; do
+	TRIES=$((TRIES + 1))
+	if [ $TRIES -gt 100 ] || ! kill -0 "$XVFB_PID" 2>/dev/null; then
+		echo "Xvfb failed to start on $DISPLAY" >&2
+		cat "$TMP/xvfb.log" >&2
+		exit 1
+	fi
+	sleep 0.05
+done
+
+# Config: mode 0 binds the marker to F12, every mode gets BINDINGS more
+mkfifo "$TMP/marker"
+
+awk -v modes="$MODES" -v bindings="$BINDINGS" -v marker="$ROOT/bench/marker $TMP/marker" 'BEGIN {
+	split("a b c d e f g h i j k l m n o p q r s t u v w x y z 0 1 2 3 4 5 6 7 8 9", keys, " ")
+	split("- shift+ ctrl+ mod1+ mod4+ ctrl+shift+ mod4+shift+ mod1+ctrl+ mod4+ctrl+ mod4+mod1+", mods, " ")
+	mods[1] = ""
+
+	for ( m = 0; m < modes; ++m )
+	{
+		printf "m%d\n{\n", m
+		if ( m == 0 )
+			printf "\tF12\n\t{\n\t\t%s\n\t}\n", marker
+
+		for ( b = 0; b < bindings && b < 360; ++b )
+		{
+			printf "\t%s%s", mods[ int( b / 36 ) + 1 ], keys[ b % 36 + 1 ]
+			if ( b == 0 && modes > 1 )
+				printf " --mode m%d", ( m + 1 ) % modes
+			printf "\n\t{\n\t\ttrue %d %d\n\t}\n", m, b
+		}
+		printf "}\n"
+	}
+}' >"$TMP/config"
+
+export XDG_CACHE_HOME="$TMP/cache"
+export XDG_CONFIG_HOME="$TMP"
+
+if [ "$COMPILE" = 1 ]; then
+	"$ROOT/xhd" -C -c "$TMP/config" >/dev/null
+fi
+
+XHD_FLAGS="-c $TMP/config"
+[ "$EXECUTOR" = 1 ] && XHD_FLAGS="$XHD_FLAGS -e"
+
+# Startup: from launch until the marker key works
+"$ROOT/xhd" $XHD_FLAGS >"$TMP/xhd.log" 2>&1 &
+XHD_PID=$!
+
+STARTUP=$("$ROOT/bench/inject" -f "$TMP/marker" -w 10000)
+LATENCY=$("$ROOT/bench/inject" -f "$TMP/marker" -n "$PRESSES" -r "$RATE")
+
+RSS_KB=$(awk '/^VmRSS:/ { print $2 }' "/proc/$XHD_PID/status")
+HWM_KB=$(awk '/^VmHWM:/ { print $2 }' "/proc/$XHD_PID/status")
+
+kill -TERM "$XHD_PID"
+wait "$XHD_PID" || true
+XHD_PID=
+
+# "Grabbed N keys in T ms, F failed"
+GRABS=$(awk '/^Grabbed/ { print "{\"keys\": " $2 ", \"ms\": " $5 ", \"failed\": " $7 "}"; exit }' "$TMP/xhd.log")
+
+RESULT=$(printf '{"modes": %s, "bindings": %s, "compiled": %s, "executor": %s, "startup": %s, "grab": %s, "rss_kb": %s, "hwm_kb": %s, "keypress": %s}' \
+	"$MODES" "$BINDINGS" "$COMPILE" "$EXECUTOR" "$STARTUP" "${GRABS:-null}" "$RSS_KB" "$HWM_KB" "$LATENCY")
+
+echo "$RESULT"
+
+if [ -n "$BENCH_OUT" ]; then
+	echo "$RESULT" >"$BENCH_OUT"
+fi
@@ -1,12 +1,9 @@
 // TODO
-// Add Mode switching
-// Add config option on command line
-// Add debug print statements
-// Add debug option on command line
-// keypress vs keyrelease distinct
-// Serial vs Parallel commands in actions
 // Handle Errors more carefully
 
+// For accept4, before any header
+#define _GNU_SOURCE
+
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-x11.h>
 #include <xcb/xcb.h>
@@ -17,6 +14,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 
 // Global XKB and XCB Variables
 int32_t             xkb_base = 0;
@@ -25,14 +23,51 @@ xcb_connection_t*   conn     = NULL;
 xcb_screen_t*       screen   = NULL;
 xcb_window_t        root;
 
+// Print every key press
+int xhd_debug = 0;
+
+// Config file location
+char config_path[ 4096 ];
+char cache_path[ 4096 ];
+
+// Reloads are delayed briefly so bursts of changes cause one reload
+#define RELOAD_DELAY_MS 50
+struct xhd_source_t* reload_timer = NULL;
+
+// An unfinished key sequence is abandoned after this long
+#define SEQUENCE_TIMEOUT_MS 1000
+struct xhd_source_t* sequence_timer = NULL;
+
+// Removed when the executor is lost
+struct xhd_source_t* executor_source = NULL;
+
+// Grabs switched off by @grab-toggle, except for the keys that switch them back on
+int grabs_suspended = 0;
+
 // We keep track MAX_KEY_CODE*MAX_GROUPS*MAX_LEVELS distinct keys.
 #define MAX_KEYCODE 256
 #define MAX_GROUPS  4
 #define MAX_LEVELS  2
 
+// The modifier state each held key went down with, releases are matched against it,
+// so letting go of the modifiers first still releases the key's binding
+// Forgotten whenever the grabs change, since the release of an ungrabbed key never arrives
+uint16_t       held_modifiers[ MAX_KEYCODE ];
+uint8_t        held_keys[ MAX_KEYCODE ];
+
 #include "xhd_types.h"
+#include "xhd_loop.h"
+#include "xhd_arena.h"
+#include "xhd_keysyms.h"
+#include "xhd_exec.h"
+#include "xhd_procs.h"
+#include "xhd_executor.h"
 #include "xhd_modes.h"
+#include "xhd_grabs.h"
+#include "xhd_stats.h"
+#include "xhd_cache.h"
 #include "xhd_config.h"
+#include "xhd_control.h"
 
 
 /**
@@ -56,6 +91,13 @@ int xhd_init ( void )
 		goto exit;
 	}
 
+	// Commands must not inherit the X connection
+	if ( xhd_exec_cloexec( xcb_get_file_descriptor( conn ) ) )
+	{
+		ret = -1;
+		goto fail1;
+	}
+
 	// Get X Screen
 	screen = xcb_setup_roots_iterator( xcb_get_setup( conn ) ).data;
 
@@ -161,6 +203,7 @@ int xhd_init ( void )
  */
 int xhd_fini ( void )
 {
+	xhd_keysyms_invalidate();
 	xkb_context_unref( ctx );
 	xcb_disconnect( conn );
 	return 0;
@@ -174,6 +217,7 @@ int xhd_fini ( void )
 int xhd_runtime_ungrab_all_keys ( void )
 {
 	xcb_ungrab_key( conn, XCB_GRAB_ANY, root, XCB_BUTTON_MASK_ANY );
+	memset( held_keys, 0, sizeof(held_keys) );
 	return 0;
 }
 
@@ -184,17 +228,193 @@ int xhd_runtime_ungrab_all_keys ( void )
  */
 int xhd_runtime_grab_all_keys ( xhd_mode_t* mode )
 {
-	uint32_t    i;
-	uint32_t    max_i = mode->grabs[ mode->cur_group ].num_grabs;
-	xhd_grab_t* list  = mode->grabs[ mode->cur_group ].list;
+	xhd_grabs_apply( mode, mode->cur_group, NULL, &mode->grabs[ mode->cur_group ] );
+	return 0;
+}
+
+/**
+ * XHD Runtime Print Grabs Function
+ *
+ * Prints how the last grabs went
+ */
+static inline
+void xhd_runtime_print_grabs ( void )
+{
+	printf( "Grabbed %u keys in %.3f ms, %u failed\n", xhd_grabs_stats.num_grabs,
+	        xhd_grabs_stats.elapsed_ns / 1e6, xhd_grabs_stats.num_failed );
+}
+
+/**
+ * XHD Runtime Apply Grabdiff Function
+ *
+ * Ungrabs and grabs only the keys that differ between two grablists
+ */
+int xhd_runtime_apply_grabdiff ( xhd_mode_t* mode, xhd_group_t group, const xhd_grabdiff_t* diff )
+{
+	xhd_grabs_apply( mode, group, &diff->ungrabs, &diff->grabs );
+	memset( held_keys, 0, sizeof(held_keys) );
+	return 0;
+}
+
+/**
+ * XHD Runtime Resume Grabs Function
+ *
+ * Grabs every key of the current mode again after @grab-toggle switched them off,
+ * so grab differences apply to the full set again
+ */
+int xhd_runtime_resume_grabs ( xhd_modelist_t* modelist )
+{
+	xhd_mode_t* mode = &modelist->modes[ modelist->cur_mode ];
+
+	if ( ! grabs_suspended )
+		return 0;
 
-	for ( i = 0; i < max_i; ++i )
+	xhd_grabs_apply( mode, mode->cur_group, NULL, &mode->grabs[ mode->cur_group ] );
+	memset( held_keys, 0, sizeof(held_keys) );
+	grabs_suspended = 0;
+
+	if ( xhd_debug )
+		printf( "Grabs resumed\n" );
+	xhd_control_broadcast( "event grabs on" );
+	return 0;
+}
+
+/**
+ * XHD Runtime Switch Mode Function
+ *
+ * Makes next_mode the current mode, sending only the grabs that differ
+ */
+int xhd_runtime_switch_mode ( xhd_modelist_t* modelist, uint32_t next_mode )
+{
+	xhd_mode_t* from = &modelist->modes[ modelist->cur_mode ];
+	xhd_mode_t* to   = &modelist->modes[ next_mode ];
+
+	if ( next_mode == modelist->cur_mode )
+		return 0;
+
+	xhd_runtime_resume_grabs( modelist );
+
+	// The group/layout is keyboard state, so it carries over
+	to->cur_group = from->cur_group;
+
+	// Switches no action makes, like those asked for over the control socket, are computed on first use
+	if ( xhd_modes_build_switch( modelist, modelist->cur_mode, next_mode ) == 0 )
 	{
-		printf("Grabbing key s=%d, k=%d\n", list[i].modifier, list[i].keycode );
-		xcb_grab_key( conn, 0, root, list[i].modifier, list[i].keycode, XCB_GRAB_MODE_SYNC, XCB_GRAB_MODE_ASYNC );
+		xhd_runtime_apply_grabdiff( to, to->cur_group, &from->switches[ XHD_SWITCH_INDEX( next_mode, from->cur_group ) ] );
+	}
+	else
+	{
+		xhd_runtime_ungrab_all_keys();
+		xhd_runtime_grab_all_keys( to );
+
+		if ( xhd_debug )
+			xhd_runtime_print_grabs();
+	}
+
+	modelist->cur_mode = next_mode;
+
+	// Entering a key sequence starts its timeout, leaving it stops it
+	if ( sequence_timer != NULL )
+		xhd_loop_arm_timer( sequence_timer, to->root != XHD_NO_MODE ? SEQUENCE_TIMEOUT_MS : 0 );
+
+	if ( xhd_debug )
+		printf( "Switched to mode %s\n", to->name );
+	xhd_control_broadcast( "event mode %s", to->name );
+	return 0;
+}
+
+/**
+ * XHD Runtime Record Spawn Function
+ *
+ * Records the time taken to launch one command
+ */
+static inline
+void xhd_runtime_record_spawn ( xhd_latency_t* latency, uint64_t elapsed )
+{
+	xhd_stats_record( &xhd_stats_global.spawn, elapsed );
+
+	if ( latency != NULL )
+		xhd_stats_record( &latency->spawn, elapsed );
+}
+
+/**
+ * XHD Runtime Spawn Function
+ *
+ * Launches one command of an action, through the executor if there is one
+ * Builtins run right here instead, worker thread handlers are queued
+ * Returns 0 if it was launched
+ */
+int xhd_runtime_spawn ( xhd_modelist_t* modelist, xhd_action_t* action, uint32_t step, xhd_latency_t* latency )
+{
+	xhd_child_t    child;
+	xhd_command_t* cmd   = action->cmds[ step ];
+	uint64_t       start = xhd_procs_now_ns();
+
+	if ( xhd_plugins_threaded( cmd ) )
+	{
+		int ret = xhd_plugins_queue( cmd, action, step );
+
+		xhd_runtime_record_spawn( latency, xhd_procs_now_ns() - start );
+		return ret;
+	}
+
+	if ( cmd->builtin != NULL )
+	{
+		int ret = cmd->builtin( modelist, cmd );
+
+		xhd_runtime_record_spawn( latency, xhd_procs_now_ns() - start );
+		return ret;
+	}
+
+	// An untracked child would never finish its action, like in the executor
+	if ( xhd_procs_full() )
+	{
+		fprintf( stderr, "Too many running commands, not running %s\n", cmd->line );
+		return -1;
+	}
+
+	if ( xhd_executor_fd >= 0 )
+	{
+		uint32_t tag = xhd_procs_track( 0, 0, cmd->line, start, action, step );
+
+		if ( xhd_executor_send( cmd, tag ) == 0 )
+		{
+			xhd_runtime_record_spawn( latency, xhd_procs_now_ns() - start );
+			return 0;
+		}
+
+		xhd_procs_take( 0, tag, &child );
+	}
+
+	pid_t pid = xhd_exec_spawn( cmd );
+
+	xhd_runtime_record_spawn( latency, xhd_procs_now_ns() - start );
+
+	if ( pid <= 0 )
+		return -1;
+
+	xhd_procs_track( pid, 0, cmd->line, start, action, step );
+	return 0;
+}
+
+/**
+ * XHD Runtime Continue Function
+ *
+ * Runs a serial action from one of its commands until a process is launched
+ * or a handler is queued, which continues it once it is done,
+ * see xhd_runtime_on_done and xhd_runtime_on_plugin_done
+ */
+int xhd_runtime_continue ( xhd_modelist_t* modelist, xhd_action_t* action, uint32_t step, xhd_latency_t* latency )
+{
+	for ( ; step < action->num_cmds; ++step )
+	{
+		if ( xhd_runtime_spawn( modelist, action, step, latency ) )
+			return -1;
+
+		if ( action->cmds[ step ]->builtin == NULL || xhd_plugins_threaded( action->cmds[ step ] ) )
+			break;
 	}
 
-	xcb_flush( conn );
 	return 0;
 }
 
@@ -203,89 +423,833 @@ int xhd_runtime_grab_all_keys ( xhd_mode_t* mode )
  *
  * Executes an action
  */
-int xhd_runtime_execute ( xhd_action_t* action )
+int xhd_runtime_execute ( xhd_modelist_t* modelist, xhd_action_t* action, xhd_latency_t* latency )
 {
-	int i;
+	uint32_t i;
+
+	if ( action->exec == XHD_EXEC_SERIAL )
+		return xhd_runtime_continue( modelist, action, 0, latency );
 
 	for ( i = 0; i < action->num_cmds; ++i )
+		xhd_runtime_spawn( modelist, action, i, latency );
+
+	return 0;
+}
+
+/**
+ * XHD Runtime On Done Function
+ *
+ * Records a finished command and adds it to its action's accounting,
+ * then continues its serial action once it succeeded
+ */
+void xhd_runtime_on_done ( xhd_procrecord_t* record, const xhd_child_t* child, void* data )
+{
+	xhd_modelist_t* modelist = (xhd_modelist_t*) data;
+	xhd_latency_t*  latency;
+
+	xhd_procs_record( record );
+
+	if ( child != NULL && child->action != NULL && ( latency = xhd_stats_action( &modelist->arena, child->action ) ) != NULL )
+		xhd_stats_account( latency, record );
+
+	// Detached by a reload, the rest of the action went with the old config
+	if ( child == NULL || child->action == NULL || child->action->exec != XHD_EXEC_SERIAL )
+		return;
+
+	if ( ! WIFEXITED( record->status ) || WEXITSTATUS( record->status ) != 0 )
+		return;
+
+	xhd_runtime_continue( modelist, child->action, child->step + 1, NULL );
+}
+
+/**
+ * XHD Runtime On Plugin Done Function
+ *
+ * Continues a serial action once its worker thread handler succeeded
+ */
+void xhd_runtime_on_plugin_done ( xhd_action_t* action, uint32_t step, int ret, void* data )
+{
+	if ( action->exec == XHD_EXEC_SERIAL && ret == 0 )
+		xhd_runtime_continue( (xhd_modelist_t*) data, action, step + 1, NULL );
+}
+
+/**
+ * XHD Runtime Drop Repeat Function
+ *
+ * Decides whether an auto-repeated press of an action is dropped, by its repeat policy
+ * and the X server time since its last run
+ */
+static inline
+int xhd_runtime_drop_repeat ( const xhd_action_t* action, xcb_timestamp_t time )
+{
+	if ( action->repeat == XHD_REPEAT_NONE )
+		return 1;
+
+	if ( action->repeat == XHD_REPEAT_COALESCE && action->running != 0 )
+		return 1;
+
+	// Server time wraps every 49 days, so compare the difference
+	return action->repeat_ms != 0 && (uint32_t) ( time - action->last_run ) < action->repeat_ms;
+}
+
+/**
+ * XHD Runtime Handle Key Function
+ *
+ * Runs the action bound to a key press or release
+ */
+int xhd_runtime_handle_key ( xhd_modelist_t* modelist, uint32_t type, xcb_key_press_event_t* keypress )
+{
+	uint64_t received = xhd_procs_now_ns();
+	uint64_t delay    = xhd_stats_delay( keypress->time, received );
+
+	uint16_t keycode  = (uint16_t) keypress->detail;
+	// Only the 8 core modifiers, held pointer buttons set the bits above them
+	uint16_t modifier = ((uint16_t) keypress->state) & ( XHD_NUM_MODIFIERS - 1 );
+	int      repeat   = 0;
+
+	// With detectable auto repeat, a held key presses again without being released
+	if ( type == XHD_EVENT_PRESS && held_keys[ keycode ] )
+	{
+		repeat   = 1;
+		modifier = held_modifiers[ keycode ];
+	}
+	else if ( type == XHD_EVENT_PRESS )
+	{
+		held_keys[ keycode ]      = 1;
+		held_modifiers[ keycode ] = modifier;
+	}
+
+	if ( type == XHD_EVENT_RELEASE && held_keys[ keycode ] )
 	{
-		char *cmd[] = {"/bin/bash", "-c", action->cmds[i], NULL}; // TODO do better with custom shells
+		held_keys[ keycode ] = 0;
+		modifier             = held_modifiers[ keycode ];
+	}
+
+	uint16_t level = modifier & 1;
+
+	uint32_t    mode_index = modelist->cur_mode;
+	xhd_mode_t* mode       = &modelist->modes[ mode_index ];
+	xhd_key_t*  key        = &mode->keymap.keys[ XHD_KEY_INDEX( mode->cur_group, keycode, level ) ];
+
+	xhd_action_t* action = xhd_modes_lookup_action( key, type, modifier );
+	uint64_t      found  = xhd_procs_now_ns();
+
+	if ( xhd_debug )
+		printf( "Got key%s s=%d, k=%d\n", type == XHD_EVENT_PRESS ? "press" : "release", modifier, keycode );
+
+	// Releases of keys without release actions are not measured
+	if ( action == NULL && type == XHD_EVENT_RELEASE )
+		return 0;
 
-		if ( fork() == 0 )
+	xhd_stats_record( &xhd_stats_global.delay, delay );
+	xhd_stats_record( &xhd_stats_global.lookup, found - received );
+
+	if ( action != NULL && repeat && xhd_runtime_drop_repeat( action, keypress->time ) )
+		return 0;
+
+	if ( action != NULL )
+	{
+		action->last_run = keypress->time;
+
+		xhd_latency_t* latency = xhd_stats_action( &modelist->arena, action );
+
+		xhd_runtime_execute( modelist, action, latency );
+
+		uint64_t done = xhd_procs_now_ns();
+		xhd_stats_record( &xhd_stats_global.total, done - received );
+
+		if ( latency != NULL )
 		{
-			if ( conn != NULL )
-				close( xcb_get_file_descriptor( conn ) );
+			xhd_stats_record( &latency->delay, delay );
+			xhd_stats_record( &latency->lookup, found - received );
+			xhd_stats_record( &latency->total, done - received );
+		}
+
+		if ( action->next_mode != XHD_NO_MODE )
+			xhd_runtime_switch_mode( modelist, action->next_mode );
+		else if ( modelist->cur_mode == mode_index && mode->root != XHD_NO_MODE )
+			xhd_runtime_switch_mode( modelist, mode->root );
+	}
+
+	return 0;
+}
 
-			execvp(cmd[0], cmd);
+/**
+ * XHD Runtime Handle Event Function
+ *
+ * Dispatches one X event
+ */
+int xhd_runtime_handle_event ( xhd_modelist_t* modelist, xcb_generic_event_t* event )
+{
+	uint8_t type = event->response_type & ~0x80;
+
+	if ( type == XCB_KEY_PRESS || type == XCB_KEY_RELEASE )
+	{
+		xhd_runtime_handle_key( modelist, type == XCB_KEY_PRESS ? XHD_EVENT_PRESS : XHD_EVENT_RELEASE,
+		                        (xcb_key_press_event_t*) event );
+	}
+	else if ( event->response_type == xkb_base )
+	{
+		xcb_xkb_state_notify_event_t* state = (xcb_xkb_state_notify_event_t*) event;
+
+		if ( state->xkbType == XCB_XKB_STATE_NOTIFY )
+		{
+			xhd_mode_t* mode = &modelist->modes[ modelist->cur_mode ];
+
+			if ( mode->cur_group != state->group && state->group < MAX_GROUPS )
+			{
+				xhd_runtime_resume_grabs( modelist );
+				xhd_runtime_apply_grabdiff( mode, state->group, &mode->deltas[ XHD_DELTA_INDEX( mode->cur_group, state->group ) ] );
+				mode->cur_group = state->group;
+
+				xhd_control_broadcast( "event group %u", (unsigned) mode->cur_group );
+			}
+		}
+		else if ( state->xkbType == XCB_XKB_MAP_NOTIFY || state->xkbType == XCB_XKB_NEW_KEYBOARD_NOTIFY )
+		{
+			// Keycodes may have moved, so rebuild the modes on the new keyboard map
+			xhd_keysyms_invalidate();
+
+			if ( reload_timer != NULL )
+				xhd_loop_arm_timer( reload_timer, RELOAD_DELAY_MS );
 		}
 	}
+
+	return 0;
 }
 
+/**
+ * XHD Runtime Reload Function
+ *
+ * Loads the config into a fresh modelist and swaps it in.
+ * Only the grabs that differ are changed; the current mode is kept
+ * if the new config still has it.
+ * If anything fails, the running config stays untouched.
+ */
+int xhd_runtime_reload ( xhd_modelist_t* modelist )
+{
+	xhd_modelist_t fresh;
+	xhd_modelist_t old;
+	xhd_grabdiff_t diff;
+
+	if ( xhd_modes_init( &fresh ) )
+		return -1;
+
+	if ( xhd_config_load( &fresh, config_path, cache_path[0] ? cache_path : NULL ) )
+	{
+		fprintf( stderr, "Reload failed; keeping the running config.\n" );
+		xhd_modes_fini( &fresh );
+		return -1;
+	}
 
-int main ( void )
+	xhd_runtime_resume_grabs( modelist );
+
+	xhd_mode_t* old_mode  = &modelist->modes[ modelist->cur_mode ];
+	xhd_mode_t* old_root  = old_mode->root == XHD_NO_MODE ? old_mode : &modelist->modes[ old_mode->root ];
+
+	// A key sequence in progress is abandoned
+	uint32_t    next_mode = xhd_modes_find_mode( &fresh, old_root->name );
+
+	fresh.cur_mode = next_mode == XHD_NO_MODE ? 0 : next_mode;
+
+	xhd_mode_t* new_mode = &fresh.modes[ fresh.cur_mode ];
+	new_mode->cur_group  = old_mode->cur_group;
+
+	if ( xhd_modes_diff_grablists( &fresh.arena, &old_mode->grabs[ old_mode->cur_group ],
+	                               &new_mode->grabs[ new_mode->cur_group ], &diff ) )
+	{
+		fprintf( stderr, "Reload failed; keeping the running config.\n" );
+		xhd_modes_fini( &fresh );
+		return -1;
+	}
+
+	xhd_runtime_apply_grabdiff( new_mode, new_mode->cur_group, &diff );
+
+	if ( sequence_timer != NULL )
+		xhd_loop_arm_timer( sequence_timer, 0 );
+
+	old       = *modelist;
+	*modelist = fresh;
+
+	// Commands still running outlive the actions that started them
+	xhd_procs_detach();
+	xhd_plugins_detach();
+	xhd_modes_fini( &old );
+
+	printf( "Reloaded %s, mode %s\n", config_path, new_mode->name );
+	xhd_control_broadcast( "event mode %s", new_mode->name );
+	return 0;
+}
+
+/**
+ * XHD Runtime On Reload Timer Function
+ *
+ * Reloads once a burst of config or keyboard map changes has settled
+ */
+void xhd_runtime_on_reload_timer ( xhd_source_t* source, uint32_t events )
 {
-	xhd_modelist_t modelist; // The current state of XHD
+	if ( xhd_loop_ack_timer( source ) )
+		xhd_runtime_reload( (xhd_modelist_t*) source->data );
+}
 
-	xhd_init();
-	xhd_modes_init( &modelist );
-	xhd_config_parse( &modelist );
-	xhd_runtime_grab_all_keys( &modelist.modes[ modelist.cur_mode ] );
+/**
+ * XHD Runtime On Sequence Timer Function
+ *
+ * Returns to the starting mode of a key sequence that was not finished in time
+ */
+void xhd_runtime_on_sequence_timer ( xhd_source_t* source, uint32_t events )
+{
+	xhd_modelist_t* modelist = (xhd_modelist_t*) source->data;
+	xhd_mode_t*     mode     = &modelist->modes[ modelist->cur_mode ];
 
+	if ( xhd_loop_ack_timer( source ) && mode->root != XHD_NO_MODE )
+	{
+		if ( xhd_debug )
+			printf( "Key sequence %s timed out\n", mode->name );
+
+		xhd_runtime_switch_mode( modelist, mode->root );
+	}
+}
+
+/**
+ * XHD Runtime On Config Function
+ *
+ * Schedules a reload when the config file changes
+ */
+void xhd_runtime_on_config ( xhd_source_t* source, uint32_t events )
+{
+	if ( xhd_config_changed( source->fd, config_path ) && reload_timer != NULL )
+		xhd_loop_arm_timer( reload_timer, RELOAD_DELAY_MS );
+}
+
+/**
+ * XHD Runtime On Signals Function
+ *
+ * Reaps finished children, answers SIGUSR1 with the command history,
+ * reloads the config on SIGHUP and stops the loop on SIGINT or SIGTERM
+ */
+void xhd_runtime_on_signals ( xhd_source_t* source, uint32_t events )
+{
+	uint64_t signals = xhd_procs_drain( source->fd );
+
+	if ( signals & ( 1ull << SIGCHLD ) )
+		xhd_procs_reap( xhd_runtime_on_done, source->data );
+
+	if ( signals & ( 1ull << SIGUSR1 ) )
+	{
+		xhd_procs_dump( stderr );
+		xhd_stats_dump( stderr, source->data );
+	}
+
+	if ( signals & ( 1ull << SIGHUP ) )
+		xhd_runtime_reload( (xhd_modelist_t*) source->data );
+
+	if ( signals & ( ( 1ull << SIGINT ) | ( 1ull << SIGTERM ) ) )
+		xhd_loop_quit = 1;
+}
+
+/**
+ * XHD Runtime On Executor Function
+ *
+ * Collects the records of commands the executor reaped
+ */
+void xhd_runtime_on_executor ( xhd_source_t* source, uint32_t events )
+{
+	xhd_executor_receive( xhd_runtime_on_done, source->data );
+
+	if ( xhd_executor_fd < 0 )
+	{
+		xhd_loop_remove( source );
+		executor_source = NULL;
+	}
+}
+
+/**
+ * XHD Runtime On Plugins Function
+ *
+ * Continues the serial actions whose worker thread handlers are done
+ */
+void xhd_runtime_on_plugins ( xhd_source_t* source, uint32_t events )
+{
+	xhd_plugins_receive( xhd_runtime_on_plugin_done, source->data );
+}
+
+/**
+ * XHD Runtime Drain Events Function
+ *
+ * Handles every X event xcb has already read from the socket
+ */
+void xhd_runtime_drain_events ( void* data )
+{
 	xcb_generic_event_t* event;
 
-	while ( 1 )
+	while ( ( event = xcb_poll_for_queued_event( conn ) ) != NULL )
 	{
-		// Take care of finished sub-processes
-		waitpid( -1, NULL, WNOHANG );
+		xhd_runtime_handle_event( (xhd_modelist_t*) data, event );
+		free( event );
+	}
 
-		// Block until event
-		event = xcb_wait_for_event( conn );
+	xcb_flush( conn );
 
-		if ( ! event )
-			continue;
+	if ( xcb_connection_has_error( conn ) )
+	{
+		fprintf( stderr, "Lost connection to X server.\n" );
+		xhd_loop_quit = 1;
+	}
+}
 
-		if ( (event->response_type & ~0x80) == XCB_KEY_PRESS )
-		{
-			xcb_key_press_event_t* keypress = (xcb_key_press_event_t*) event;
+/**
+ * XHD Runtime On X Function
+ *
+ * Reads the X socket once, then handles everything it queued
+ */
+void xhd_runtime_on_x ( xhd_source_t* source, uint32_t events )
+{
+	xcb_generic_event_t* event = xcb_poll_for_event( conn );
 
-			uint16_t keycode  = (uint16_t) keypress->detail;
-			uint16_t modifier = ((uint16_t) keypress->state) & 0x9FFF;
-			uint16_t level    = modifier & 1;
-			printf("Got keypress s=%d, k=%d\n", modifier, keycode );
+	if ( event != NULL )
+	{
+		xhd_runtime_handle_event( (xhd_modelist_t*) source->data, event );
+		free( event );
+	}
 
-			xhd_key_t* key = &modelist.modes[ modelist.cur_mode ].keymap[ modelist.modes[ modelist.cur_mode ].cur_group ][ keycode ][ level ];
+	xhd_runtime_drain_events( source->data );
+}
 
-			int i;
-			for ( i = 0; i < key->num_acts; ++i )
-			{
-				if ( key->acts[i].mod == modifier )
-				{
-					xhd_runtime_execute( &key->acts[i] );
-					break;
-				}
-			}
+/**
+ * XHD Runtime Run Named Function
+ *
+ * Runs an action by the name it was given with --name
+ */
+int xhd_runtime_run_named ( xhd_modelist_t* modelist, const char* name )
+{
+	uint32_t      mode_index;
+	xhd_action_t* action = xhd_modes_find_named( modelist, name, &mode_index );
+
+	if ( action == NULL )
+		return -ENOENT;
+
+	xhd_runtime_execute( modelist, action, NULL );
+
+	// A --mode is followed from anywhere, but a key sequence is only
+	// completed if it was in progress
+	if ( action->next_mode != XHD_NO_MODE )
+		xhd_runtime_switch_mode( modelist, action->next_mode );
+	else if ( mode_index == modelist->cur_mode && modelist->modes[ mode_index ].root != XHD_NO_MODE )
+		xhd_runtime_switch_mode( modelist, modelist->modes[ mode_index ].root );
+
+	return 0;
+}
+
+/**
+ * XHD Runtime Reply Stats Function
+ *
+ * Sends the command history and latency histograms to a control client
+ */
+int xhd_runtime_reply_stats ( xhd_control_client_t* client, xhd_modelist_t* modelist )
+{
+	char*  text = NULL;
+	size_t len  = 0;
+	FILE*  out  = open_memstream( &text, &len );
+
+	if ( out == NULL )
+		return xhd_control_reply( client, "error no memory" );
+
+	xhd_procs_dump( out );
+	xhd_stats_dump( out, modelist );
+	fclose( out );
+
+	int ret = xhd_control_reply_data( client, text, len );
+	free( text );
+
+	return ret ? ret : xhd_control_reply( client, "ok" );
+}
+
+/**
+ * XHD Runtime On Request Function
+ *
+ * Answers one control socket request
+ */
+void xhd_runtime_on_request ( xhd_control_client_t* client, const char* verb, const char* arg, void* data )
+{
+	xhd_modelist_t* modelist = (xhd_modelist_t*) data;
+	xhd_mode_t*     mode     = &modelist->modes[ modelist->cur_mode ];
+
+	if ( strcmp( verb, "run" ) == 0 )
+	{
+		if ( xhd_runtime_run_named( modelist, arg ) )
+			xhd_control_reply( client, "error no action named %s", arg );
+		else
+			xhd_control_reply( client, "ok" );
+	}
+	else if ( strcmp( verb, "mode" ) == 0 )
+	{
+		uint32_t next_mode = xhd_modes_find_mode( modelist, arg );
+
+		// Key sequences are only entered from the keyboard
+		if ( next_mode == XHD_NO_MODE || modelist->modes[ next_mode ].root != XHD_NO_MODE )
+		{
+			xhd_control_reply( client, "error no mode named %s", arg );
+			return;
 		}
-		else if ( event->response_type == xkb_base )
+
+		xhd_runtime_switch_mode( modelist, next_mode );
+		xhd_control_reply( client, "ok" );
+	}
+	else if ( strcmp( verb, "reload" ) == 0 )
+	{
+		if ( xhd_runtime_reload( modelist ) )
+			xhd_control_reply( client, "error reload failed; keeping the running config" );
+		else
+			xhd_control_reply( client, "ok" );
+	}
+	else if ( strcmp( verb, "stats" ) == 0 )
+	{
+		xhd_runtime_reply_stats( client, modelist );
+	}
+	else if ( strcmp( verb, "state" ) == 0 || strcmp( verb, "subscribe" ) == 0 )
+	{
+		// Subscribers start from the current state, then follow the events
+		if ( strcmp( verb, "subscribe" ) == 0 )
+			client->subscribed = 1;
+
+		xhd_control_reply( client, "ok mode %s group %u", mode->name, (unsigned) mode->cur_group );
+	}
+	else
+	{
+		xhd_control_reply( client, "error unknown request %s", verb );
+	}
+}
+
+/**
+ * XHD Runtime Builtin Mode Function
+ *
+ * @mode NAME switches to mode NAME
+ */
+int xhd_runtime_builtin_mode ( xhd_modelist_t* modelist, const xhd_command_t* cmd )
+{
+	uint32_t next_mode = xhd_modes_find_mode( modelist, cmd->arg );
+
+	if ( next_mode == XHD_NO_MODE || modelist->modes[ next_mode ].root != XHD_NO_MODE )
+	{
+		fprintf( stderr, "@mode: no mode named %s\n", cmd->arg );
+		return -1;
+	}
+
+	return xhd_runtime_switch_mode( modelist, next_mode );
+}
+
+/**
+ * XHD Runtime Builtin Reload Function
+ *
+ * @reload reloads the config
+ */
+int xhd_runtime_builtin_reload ( xhd_modelist_t* modelist, const xhd_command_t* cmd )
+{
+	// The running action belongs to the config being replaced, so reload from the loop
+	if ( reload_timer == NULL )
+		return -1;
+
+	return xhd_loop_arm_timer( reload_timer, 1 );
+}
+
+/**
+ * XHD Runtime Builtin Stats Function
+ *
+ * @stats prints what SIGUSR1 prints
+ */
+int xhd_runtime_builtin_stats ( xhd_modelist_t* modelist, const xhd_command_t* cmd )
+{
+	xhd_procs_dump( stderr );
+	xhd_stats_dump( stderr, modelist );
+	return 0;
+}
+
+/**
+ * XHD Runtime Builtin Grab Toggle Function
+ *
+ * @grab-toggle lets go of every key of the current mode, except the keys
+ * bound to @grab-toggle, and grabs them again the next time
+ */
+int xhd_runtime_builtin_grab_toggle ( xhd_modelist_t* modelist, const xhd_command_t* cmd )
+{
+	uint32_t        i, j, e;
+	xhd_mode_t*     mode  = &modelist->modes[ modelist->cur_mode ];
+	xhd_grablist_t* grabs = &mode->grabs[ mode->cur_group ];
+	xhd_grablist_t  ungrabs;
+
+	if ( grabs_suspended )
+		return xhd_runtime_resume_grabs( modelist );
+
+	ungrabs.num_grabs   = 0;
+	ungrabs.alloc_grabs = grabs->num_grabs + 1;
+	ungrabs.list        = (xhd_grab_t*) malloc( sizeof(xhd_grab_t) * ungrabs.alloc_grabs );
+
+	if ( ungrabs.list == NULL )
+		return -ENOMEM;
+
+	for ( i = 0; i < grabs->num_grabs; ++i )
+	{
+		const xhd_grab_t* grab = &grabs->list[i];
+		const xhd_key_t*  key  = &mode->keymap.keys[ XHD_KEY_INDEX( mode->cur_group, grab->keycode, grab->modifier & 1 ) ];
+		int               keep = 0;
+
+		for ( e = 0; e < XHD_NUM_EVENTS; ++e )
 		{
-			xcb_xkb_state_notify_event_t* state = (xcb_xkb_state_notify_event_t*) event;
+			const xhd_action_t* action = xhd_modes_lookup_action( key, e, grab->modifier );
 
-			if ( state->xkbType == XCB_XKB_STATE_NOTIFY )
-			{
-				if ( modelist.modes[ modelist.cur_mode ].cur_group != state->group )
+			for ( j = 0; action != NULL && j < action->num_cmds; ++j )
+				keep |= action->cmds[j]->builtin == xhd_runtime_builtin_grab_toggle;
+		}
+
+		if ( ! keep )
+			ungrabs.list[ ungrabs.num_grabs++ ] = *grab;
+	}
+
+	xhd_grabs_apply( mode, mode->cur_group, &ungrabs, NULL );
+	memset( held_keys, 0, sizeof(held_keys) );
+	free( ungrabs.list );
+	grabs_suspended = 1;
+
+	if ( xhd_debug )
+		printf( "Grabs suspended\n" );
+	xhd_control_broadcast( "event grabs off" );
+	return 0;
+}
+
+// The builtins a command names as "@name"
+const xhd_builtin_t xhd_runtime_builtins[] =
+{
+	{ "mode",        xhd_runtime_builtin_mode,        1 },
+	{ "reload",      xhd_runtime_builtin_reload,      0 },
+	{ "stats",       xhd_runtime_builtin_stats,       0 },
+	{ "grab-toggle", xhd_runtime_builtin_grab_toggle, 0 },
+	{ NULL,          NULL,                            0 }
+};
+
+/**
+ * XHD Usage Function
+ *
+ * Prints the command line options
+ */
+void xhd_usage ( const char* name )
+{
+	fprintf( stderr, "Usage: %s [-c config] [-C] [-d] [-e] [-s socket] [-h]\n", name );
+	fprintf( stderr, "       %s [-s socket] -r request...\n", name );
+	fprintf( stderr, "  -c, --config   Read this config instead of $XDG_CONFIG_HOME/xhd/config\n" );
+	fprintf( stderr, "  -C, --compile  Compile the config into the cache and exit\n" );
+	fprintf( stderr, "  -d, --debug    Print every key press\n" );
+	fprintf( stderr, "  -e, --executor Launch commands from a pre-forked executor process\n" );
+	fprintf( stderr, "  -r, --request  Send the remaining arguments to a running xhd and print the reply\n" );
+	fprintf( stderr, "  -s, --socket   Use this control socket instead of $XDG_RUNTIME_DIR/xhd-$DISPLAY.sock\n" );
+	fprintf( stderr, "  -h, --help     Print this help\n" );
+}
+
+int main ( int argc, char** argv )
+{
+	xhd_modelist_t modelist; // The current state of XHD
+	int use_executor = 0;
+	int compile      = 0;
+	int request      = 0;
+	int opt;
+
+	char socket_path[ sizeof(xhd_control_path) ];
+
+	static const struct option options[] =
+	{
+		{ "config",   required_argument, NULL, 'c' },
+		{ "compile",  no_argument,       NULL, 'C' },
+		{ "debug",    no_argument,       NULL, 'd' },
+		{ "executor", no_argument,       NULL, 'e' },
+		{ "request",  no_argument,       NULL, 'r' },
+		{ "socket",   required_argument, NULL, 's' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL,       0,                 NULL, 0   }
+	};
+
+	config_path[0] = '\0';
+	cache_path[0]  = '\0';
+	socket_path[0] = '\0';
+
+	xhd_modes_builtins = xhd_runtime_builtins;
+
+	while ( ( opt = getopt_long( argc, argv, "c:Cderhs:", options, NULL ) ) != -1 )
+	{
+		switch ( opt )
+		{
+			case 'c':
+				snprintf( config_path, sizeof(config_path), "%s", optarg );
+				break;
+			case 'C':
+				compile = 1;
+				break;
+			case 'd':
+				xhd_debug = 1;
+				break;
+			case 'e':
+				use_executor = 1;
+				break;
+			case 'r':
+				request = 1;
+				break;
+			case 's':
+				if ( snprintf( socket_path, sizeof(socket_path), "%s", optarg ) >= (int) sizeof(socket_path) )
 				{
-					xhd_runtime_ungrab_all_keys();
-					modelist.modes[ modelist.cur_mode ].cur_group = state->group;
-					xhd_runtime_grab_all_keys( &modelist.modes[ modelist.cur_mode ] );
+					fprintf( stderr, "Socket path too long: %s\n", optarg );
+					return 1;
 				}
-			}
+				break;
+			case 'h':
+				xhd_usage( argv[0] );
+				return 0;
+			default:
+				xhd_usage( argv[0] );
+				return 1;
+		}
+	}
+
+	if ( socket_path[0] == '\0' && xhd_control_default_path( socket_path, sizeof(socket_path) ) )
+		socket_path[0] = '\0';
+
+	// Talk to the running daemon instead of becoming one
+	if ( request )
+	{
+		char msg[ XHD_CONTROL_MAXMSG ];
+		int  len = 0;
+
+		if ( optind >= argc || socket_path[0] == '\0' )
+		{
+			xhd_usage( argv[0] );
+			return 1;
 		}
 
-		if ( event != NULL )
+		for ( ; optind < argc && len < (int) sizeof(msg); ++optind )
+			len += snprintf( msg + len, sizeof(msg) - len, len ? " %s" : "%s", argv[ optind ] );
+
+		if ( len >= (int) sizeof(msg) )
 		{
-			free( event );
+			fprintf( stderr, "Request too long\n" );
+			return 1;
 		}
+
+		return xhd_control_request( socket_path, msg, stdout );
+	}
+
+	if ( config_path[0] == '\0' && xhd_config_default_path( config_path, sizeof(config_path) ) )
+		return 1;
+
+	// Without a cache location, always parse
+	if ( xhd_cache_default_path( config_path, cache_path, sizeof(cache_path) ) )
+		cache_path[0] = '\0';
+
+	// The cache is tied to the keyboard map, so compiling needs the server too
+	if ( compile )
+	{
+		if ( cache_path[0] == '\0' || xhd_init() )
+			return 1;
+
+		int ret = xhd_config_compile( config_path, cache_path );
+
+		if ( ret == 0 )
+			printf( "Compiled %s into %s\n", config_path, cache_path );
+
+		xhd_plugins_unload();
+		xhd_fini();
+		return ret ? 1 : 0;
+	}
+
+	xhd_exec_init();
+
+	// Fork the executor while the daemon is still small
+	if ( use_executor )
+		xhd_executor_start();
+
+	if ( xhd_init() )
+		return 1;
+
+	if ( xhd_modes_init( &modelist ) || xhd_config_load( &modelist, config_path, cache_path[0] ? cache_path : NULL ) )
+		return 1;
+
+	xhd_runtime_grab_all_keys( &modelist.modes[ modelist.cur_mode ] );
+	xhd_runtime_print_grabs();
+
+	// Children, requests for the command history, reloads and termination arrive through a signalfd
+	sigset_t mask;
+	sigemptyset( &mask );
+	sigaddset( &mask, SIGUSR1 );
+	sigaddset( &mask, SIGHUP );
+	sigaddset( &mask, SIGINT );
+	sigaddset( &mask, SIGTERM );
+
+	int signal_fd = xhd_procs_signalfd( &mask );
+
+	if ( signal_fd < 0 || xhd_loop_init() || xhd_plugins_init() )
+		return 1;
+
+	xhd_source_t* x_source      = xhd_loop_add( xcb_get_file_descriptor( conn ), EPOLLIN, xhd_runtime_on_x, &modelist );
+	xhd_source_t* signal_source = xhd_loop_add( signal_fd, EPOLLIN, xhd_runtime_on_signals, &modelist );
+	xhd_source_t* plugin_source = xhd_loop_add( xhd_plugins_fd, EPOLLIN, xhd_runtime_on_plugins, &modelist );
+
+	if ( x_source == NULL || signal_source == NULL || plugin_source == NULL )
+		return 1;
+
+	if ( xhd_executor_fd >= 0 )
+		executor_source = xhd_loop_add( xhd_executor_fd, EPOLLIN, xhd_runtime_on_executor, &modelist );
+
+	// Config edits are picked up live; without a watch, the config is just static
+	int           config_fd     = xhd_config_watch( config_path );
+	xhd_source_t* config_source = NULL;
+
+	reload_timer   = xhd_loop_add_timer( xhd_runtime_on_reload_timer, &modelist );
+	sequence_timer = xhd_loop_add_timer( xhd_runtime_on_sequence_timer, &modelist );
+
+	if ( config_fd >= 0 )
+		config_source = xhd_loop_add( config_fd, EPOLLIN, xhd_runtime_on_config, NULL );
+
+	// Without a control socket, xhd still works from the keyboard
+	if ( socket_path[0] != '\0' )
+		xhd_control_open( socket_path, xhd_runtime_on_request, &modelist );
+
+	xhd_loop_run( xhd_runtime_drain_events, &modelist );
+
+	xhd_control_close();
+
+	if ( reload_timer != NULL )
+	{
+		xhd_loop_remove( reload_timer );
+		close( reload_timer->fd );
+		reload_timer = NULL;
+	}
+
+	if ( sequence_timer != NULL )
+	{
+		xhd_loop_remove( sequence_timer );
+		close( sequence_timer->fd );
+		sequence_timer = NULL;
+	}
+
+	if ( config_fd >= 0 )
+	{
+		xhd_loop_remove( config_source );
+		close( config_fd );
+	}
+
+	xhd_loop_remove( x_source );
+	xhd_loop_remove( signal_source );
+	xhd_loop_remove( plugin_source );
+
+	if ( executor_source != NULL )
+	{
+		xhd_loop_remove( executor_source );
+		executor_source = NULL;
 	}
 
+	xhd_loop_fini();
+	close( signal_fd );
 	xhd_modes_fini( &modelist );
+	xhd_plugins_unload();
+	xhd_grabs_free();
+	xhd_executor_stop();
+	xhd_exec_fini();
 	xhd_fini();
 }
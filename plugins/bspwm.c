@@ -0,0 +1,174 @@
+/**
+ * XHD bspwm Plugin
+ *
+ * "@bspwm:bspc node -f west" sends what "bspc node -f west" sends to bspwm,
+ * without starting bspc. Arguments are split on whitespace, without quoting.
+ * Runs on the worker thread, since bspwm answers once it handled the message.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "../xhd_plugin.h"
+
+// bspwm starts a reply with this byte when the message failed
+#define BSPWM_FAILURE 7
+
+typedef struct bspwm_message_t
+{
+	size_t len;
+	char   data[];		// The arguments, each ended by a NUL
+
+} bspwm_message_t;
+
+/**
+ * bspwm Init Function
+ *
+ * Finds the socket the way bspc does: $BSPWM_SOCKET,
+ * else /tmp/bspwm<host>_<display>_<screen>-socket from $DISPLAY
+ */
+static int bspwm_init ( void** state )
+{
+	struct sockaddr_un* addr    = (struct sockaddr_un*) calloc( 1, sizeof(struct sockaddr_un) );
+	const char*         path    = getenv( "BSPWM_SOCKET" );
+	const char*         display = getenv( "DISPLAY" );
+
+	if ( addr == NULL )
+		return -ENOMEM;
+
+	addr->sun_family = AF_UNIX;
+
+	if ( path != NULL && path[0] != '\0' )
+	{
+		snprintf( addr->sun_path, sizeof(addr->sun_path), "%s", path );
+	}
+	else
+	{
+		const char* colon  = display != NULL ? strrchr( display, ':' ) : NULL;
+		int         number = 0;
+		int         screen = 0;
+
+		if ( colon == NULL )
+		{
+			free( addr );
+			return -EINVAL;
+		}
+
+		sscanf( colon + 1, "%d.%d", &number, &screen );
+		snprintf( addr->sun_path, sizeof(addr->sun_path), "/tmp/bspwm%.*s_%d_%d-socket", (int) ( colon - display ), display, number, screen );
+	}
+
+	*state = addr;
+	return 0;
+}
+
+static void bspwm_fini ( void* state )
+{
+	free( state );
+}
+
+/**
+ * bspwm Prepare Function
+ *
+ * Builds the message once, when the config is loaded
+ */
+static int bspwm_prepare ( void* state, const char* arg, void** cookie )
+{
+	size_t           i, len = strlen( arg );
+	bspwm_message_t* msg    = (bspwm_message_t*) malloc( sizeof(bspwm_message_t) + len + 1 );
+
+	if ( msg == NULL )
+		return -ENOMEM;
+
+	msg->len = 0;
+
+	for ( i = 0; i < len; ++i )
+	{
+		if ( arg[i] != ' ' && arg[i] != '\t' )
+			msg->data[ msg->len++ ] = arg[i];
+		else if ( msg->len != 0 && msg->data[ msg->len - 1 ] != '\0' )
+			msg->data[ msg->len++ ] = '\0';
+	}
+
+	if ( msg->len == 0 )
+	{
+		free( msg );
+		return -EINVAL;
+	}
+
+	if ( msg->data[ msg->len - 1 ] != '\0' )
+		msg->data[ msg->len++ ] = '\0';
+
+	*cookie = msg;
+	return 0;
+}
+
+static int bspwm_run ( void* state, void* cookie )
+{
+	const struct sockaddr_un* addr   = (const struct sockaddr_un*) state;
+	const bspwm_message_t*    msg    = (const bspwm_message_t*) cookie;
+	char                      reply[ 512 ];
+	ssize_t                   len;
+	int                       ret    = 0;
+	int                       failed = 0;
+	int                       first;
+	int                       fd     = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+	if ( fd < 0 )
+		return -errno;
+
+	if ( connect( fd, (const struct sockaddr*) addr, sizeof(*addr) ) || send( fd, msg->data, msg->len, MSG_NOSIGNAL ) < 0 )
+	{
+		ret = -errno;
+		goto exit;
+	}
+
+	// bspwm closes the connection after its reply, which may be empty
+	// Output of queries is dropped, only failures are shown
+	for ( first = 1; ( len = recv( fd, reply, sizeof(reply) - 1, 0 ) ) > 0; first = 0 )
+	{
+		if ( first )
+			failed = reply[0] == BSPWM_FAILURE;
+
+		if ( failed )
+		{
+			reply[ len ] = '\0';
+			fprintf( stderr, "bspwm: %s", first ? reply + 1 : reply );
+		}
+	}
+
+	ret = failed;
+
+	exit:
+		close( fd );
+		return ret;
+}
+
+static void bspwm_release ( void* state, void* cookie )
+{
+	free( cookie );
+}
+
+static const xhd_plugin_handler_t bspwm_handlers[] =
+{
+	{ "bspc", XHD_PLUGIN_THREAD, bspwm_prepare, bspwm_run, bspwm_release },
+	{ NULL,   0,                 NULL,          NULL,      NULL          }
+};
+
+static const xhd_plugin_t bspwm_plugin =
+{
+	XHD_PLUGIN_ABI_VERSION,
+	"bspwm",
+	bspwm_init,
+	bspwm_fini,
+	bspwm_handlers
+};
+
+const xhd_plugin_t* xhd_plugin_entry ( void )
+{
+	return &bspwm_plugin;
+}
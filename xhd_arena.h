@@ -0,0 +1,138 @@
+#ifndef XHD_ARENA_LIB_H
+#define XHD_ARENA_LIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "xhd_types.h"
+
+#define XHD_ARENA_CHUNK_SIZE ( 64 * 1024 )
+#define XHD_ARENA_ALIGN      16
+
+/**
+ * XHD Arena Init Function
+ *
+ * Initializes an empty arena, chunks are allocated on first use
+ */
+void xhd_arena_init ( xhd_arena_t* arena )
+{
+	arena->chunks = NULL;
+	arena->size   = 0;
+}
+
+/**
+ * XHD Arena Alloc Function
+ *
+ * Returns size zeroed bytes that live until the arena is released, or NULL
+ * Allocations larger than a chunk get a chunk of their own
+ */
+void* xhd_arena_alloc ( xhd_arena_t* arena, size_t size )
+{
+	xhd_arena_chunk_t* chunk = arena->chunks;
+
+	size = ( size + XHD_ARENA_ALIGN - 1 ) & ~(size_t) ( XHD_ARENA_ALIGN - 1 );
+
+	if ( chunk == NULL || chunk->size - chunk->used < size )
+	{
+		size_t chunk_size = size > XHD_ARENA_CHUNK_SIZE ? size : XHD_ARENA_CHUNK_SIZE;
+
+		chunk = (xhd_arena_chunk_t*) malloc( sizeof(xhd_arena_chunk_t) + chunk_size );
+
+		if ( chunk == NULL )
+		{
+			fprintf( stderr, "Failed to grow arena: no memory\n" );
+			return NULL;
+		}
+
+		chunk->size  = chunk_size;
+		chunk->used  = 0;
+		arena->size += chunk_size;
+
+		// Keep the fuller chunk in front when a large allocation gets its own
+		if ( arena->chunks != NULL && chunk_size == size )
+		{
+			chunk->next          = arena->chunks->next;
+			arena->chunks->next  = chunk;
+		}
+		else
+		{
+			chunk->next   = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	void* ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	memset( ptr, 0, size );
+	return ptr;
+}
+
+/**
+ * XHD Arena Strndup Function
+ *
+ * Copies len characters of a string into the arena, NUL terminated
+ */
+char* xhd_arena_strndup ( xhd_arena_t* arena, const char* str, size_t len )
+{
+	char* copy = (char*) xhd_arena_alloc( arena, len + 1 );
+
+	if ( copy != NULL )
+		memcpy( copy, str, len );
+
+	return copy;
+}
+
+/**
+ * XHD Arena Strdup Function
+ *
+ * Copies a string into the arena
+ */
+char* xhd_arena_strdup ( xhd_arena_t* arena, const char* str )
+{
+	return xhd_arena_strndup( arena, str, strlen( str ) );
+}
+
+/**
+ * XHD Arena Release Function
+ *
+ * Frees everything allocated from the arena at once
+ */
+void xhd_arena_release ( xhd_arena_t* arena )
+{
+	xhd_arena_chunk_t* chunk = arena->chunks;
+
+	while ( chunk != NULL )
+	{
+		xhd_arena_chunk_t* next = chunk->next;
+		free( chunk );
+		chunk = next;
+	}
+
+	arena->chunks = NULL;
+	arena->size   = 0;
+}
+
+/**
+ * XHD Arena Hash Function
+ *
+ * FNV-1a of len characters, used to intern strings kept in arenas
+ */
+static inline
+uint32_t xhd_arena_hash ( const char* str, size_t len )
+{
+	uint32_t hash = 2166136261u;
+	size_t   i;
+
+	for ( i = 0; i < len; ++i )
+	{
+		hash ^= (unsigned char) str[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+#endif
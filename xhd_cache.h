@@ -0,0 +1,787 @@
+#ifndef XHD_CACHE_LIB_H
+#define XHD_CACHE_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xhd_types.h"
+#include "xhd_modes.h"
+
+/**
+ * The Config Cache
+ *
+ * A compiled config, written by xhd --compile and mapped read-only at startup.
+ * It holds every mode's grablists, actions and bindings, already resolved to
+ * keymap positions, so loading it needs no parsing and no keysym lookups.
+ * Loading replays it: modes, actions and bindings are registered again from
+ * the mapped tables, then the mapping is dropped.
+ * Bindings refer to actions by index, so shared actions stay shared.
+ *
+ * All references inside the file are byte offsets from its start,
+ * so it does not depend on where it is mapped.
+ * It is only used if it matches the hash of the config file,
+ * the hash of the keyboard map's symbols, and this build's layout.
+ */
+#define XHD_CACHE_MAGIC   0x43444858	// "XHDC"
+#define XHD_CACHE_VERSION 9
+
+typedef struct xhd_cache_header_t
+{
+	uint32_t magic;			// XHD_CACHE_MAGIC
+	uint32_t version;		// XHD_CACHE_VERSION
+	uint64_t config_hash;	// Hash of the config file contents
+	uint64_t keymap_hash;	// Hash of the keysym table
+	uint32_t max_groups;	// Keymap dimensions of the writer
+	uint32_t max_keycode;
+	uint32_t max_levels;
+	uint32_t size;			// Size of the whole file
+	uint32_t num_modes;		// The number of modes
+	uint32_t modes;			// Offset of the xhd_cache_mode_t array
+
+} xhd_cache_header_t;
+
+typedef struct xhd_cache_mode_t
+{
+	uint32_t name;							// Offset of the name
+	uint32_t root;							// Index of the mode a key sequence started in
+	uint32_t num_grabs[ MAX_GROUPS ];		// Grablist lengths
+	uint32_t grabs[ MAX_GROUPS ];			// Offsets of the xhd_grab_t arrays
+	uint32_t num_actions;					// The number of actions
+	uint32_t actions;						// Offset of the xhd_cache_action_t array
+	uint32_t num_bindings;					// The number of bindings
+	uint32_t bindings;						// Offset of the xhd_cache_binding_t array
+	uint32_t num_named;						// The number of named actions
+	uint32_t named;							// Offset of their indices into actions
+
+} xhd_cache_mode_t;
+
+typedef struct xhd_cache_action_t
+{
+	uint32_t next_name;		// Offset of the mode to switch to, 0 for none
+	uint32_t name;			// Offset of the name to run it by, 0 for none
+	uint32_t exec;			// How the commands are run, see XHD_EXEC_PARALLEL
+	uint32_t repeat;		// Auto-repeat policy, see XHD_REPEAT_ALL
+	uint32_t repeat_ms;		// Least time between repeated runs
+	uint32_t num_cmds;		// The number of commands
+	uint32_t cmds;			// Offset of the command string offsets
+
+} xhd_cache_action_t;
+
+typedef struct xhd_cache_binding_t
+{
+	uint32_t key_index;		// Keymap position, see XHD_KEY_INDEX
+	uint32_t event;			// XHD_EVENT_PRESS or XHD_EVENT_RELEASE
+	uint32_t mod;			// Modifier state
+	uint32_t action;		// Index into the mode's actions
+
+} xhd_cache_binding_t;
+
+/**
+ * A growable buffer the cache is built in
+ * Strings are written once, the table maps them to their offsets
+ */
+typedef struct xhd_cache_buf_t
+{
+	char*     data;
+	uint32_t  len;
+	uint32_t  alloc;
+
+	uint32_t  num_strings;
+	uint32_t  alloc_strings;	// A power of two
+	uint32_t* strings;			// Offsets of the written strings, 0 if empty
+
+} xhd_cache_buf_t;
+
+/**
+ * XHD Cache Hash Function
+ *
+ * FNV-1a, continued from hash
+ */
+static inline
+uint64_t xhd_cache_hash ( uint64_t hash, const void* data, size_t len )
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	size_t i;
+
+	for ( i = 0; i < len; ++i )
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+#define XHD_CACHE_HASH_INIT 0xcbf29ce484222325ull
+
+/**
+ * XHD Cache Hash File Function
+ *
+ * Hashes the contents of a file
+ */
+int xhd_cache_hash_file ( const char* path, uint64_t* hash )
+{
+	struct stat st;
+	int fd = open( path, O_RDONLY | O_CLOEXEC );
+
+	if ( fd < 0 )
+		return -1;
+
+	if ( fstat( fd, &st ) )
+	{
+		close( fd );
+		return -1;
+	}
+
+	*hash = XHD_CACHE_HASH_INIT;
+
+	if ( st.st_size > 0 )
+	{
+		void* data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+		if ( data == MAP_FAILED )
+		{
+			close( fd );
+			return -1;
+		}
+
+		*hash = xhd_cache_hash( *hash, data, st.st_size );
+		munmap( data, st.st_size );
+	}
+
+	close( fd );
+	return 0;
+}
+
+/**
+ * XHD Cache Keymap Hash Function
+ *
+ * Identifies a keyboard map by the symbols it puts on every key
+ */
+uint64_t xhd_cache_keymap_hash ( const xhd_keysyms_t* keysyms )
+{
+	return xhd_cache_hash( XHD_CACHE_HASH_INIT, keysyms->symbols, sizeof(keysyms->symbols) );
+}
+
+/**
+ * XHD Cache Default Path Function
+ *
+ * Writes $XDG_CACHE_HOME/xhd/config-<hash of config path>.bin,
+ * else the same under $HOME/.cache, so every config has its own cache
+ */
+int xhd_cache_default_path ( const char* config_path, char* cache_path, size_t len )
+{
+	uint64_t    hash       = xhd_cache_hash( XHD_CACHE_HASH_INIT, config_path, strlen( config_path ) );
+	const char* cache_home = getenv( "XDG_CACHE_HOME" );
+
+	if ( cache_home != NULL && cache_home[0] != '\0' )
+	{
+		snprintf( cache_path, len, "%s/xhd/config-%016llx.bin", cache_home, (unsigned long long) hash );
+		return 0;
+	}
+
+	cache_home = getenv( "HOME" );
+
+	if ( cache_home == NULL )
+		return -1;
+
+	snprintf( cache_path, len, "%s/.cache/xhd/config-%016llx.bin", cache_home, (unsigned long long) hash );
+	return 0;
+}
+
+/**
+ * XHD Cache Reserve Function
+ *
+ * Appends len zeroed, 8 byte aligned bytes to a buffer
+ * Returns their offset, or 0 without memory
+ */
+static
+uint32_t xhd_cache_reserve ( xhd_cache_buf_t* buf, uint32_t len )
+{
+	uint32_t offset = ( buf->len + 7 ) & ~7u;
+
+	if ( offset + len > buf->alloc )
+	{
+		uint32_t alloc = buf->alloc * 2 + len + 4096;
+		char*    tmp   = (char*) realloc( buf->data, alloc );
+
+		if ( tmp == NULL )
+			return 0;
+
+		buf->data  = tmp;
+		buf->alloc = alloc;
+	}
+
+	memset( buf->data + buf->len, 0, offset + len - buf->len );
+	buf->len = offset + len;
+	return offset;
+}
+
+static
+uint32_t xhd_cache_put_string ( xhd_cache_buf_t* buf, const char* str )
+{
+	uint32_t i;
+
+	// Keep the table at most half full
+	if ( ( buf->num_strings + 1 ) * 2 > buf->alloc_strings )
+	{
+		uint32_t  alloc_strings = buf->alloc_strings ? buf->alloc_strings * 2 : 256;
+		uint32_t* tmp           = (uint32_t*) calloc( alloc_strings, sizeof(uint32_t) );
+
+		if ( tmp == NULL )
+			return 0;
+
+		for ( i = 0; i < buf->alloc_strings; ++i )
+		{
+			uint32_t pos;
+
+			if ( buf->strings[i] == 0 )
+				continue;
+
+			for ( pos = xhd_arena_hash( buf->data + buf->strings[i], strlen( buf->data + buf->strings[i] ) ) & ( alloc_strings - 1 ); tmp[ pos ] != 0; pos = ( pos + 1 ) & ( alloc_strings - 1 ) );
+
+			tmp[ pos ] = buf->strings[i];
+		}
+
+		free( buf->strings );
+		buf->strings       = tmp;
+		buf->alloc_strings = alloc_strings;
+	}
+
+	for ( i = xhd_arena_hash( str, strlen( str ) ) & ( buf->alloc_strings - 1 ); buf->strings[i] != 0; i = ( i + 1 ) & ( buf->alloc_strings - 1 ) )
+	{
+		if ( strcmp( buf->data + buf->strings[i], str ) == 0 )
+			return buf->strings[i];
+	}
+
+	uint32_t len    = strlen( str ) + 1;
+	uint32_t offset = xhd_cache_reserve( buf, len );
+
+	if ( offset == 0 )
+		return 0;
+
+	memcpy( buf->data + offset, str, len );
+	buf->strings[i] = offset;
+	buf->num_strings++;
+	return offset;
+}
+
+static
+int xhd_cache_compare_action ( const void* a, const void* b )
+{
+	const xhd_action_t* x = *(const xhd_action_t* const*) a;
+	const xhd_action_t* y = *(const xhd_action_t* const*) b;
+
+	return ( x > y ) - ( x < y );
+}
+
+/**
+ * XHD Cache Build Action Function
+ *
+ * Serializes one action into the buffer
+ */
+static
+int xhd_cache_build_action ( xhd_cache_buf_t* buf, uint32_t action_offset, const xhd_action_t* action )
+{
+	uint32_t i;
+	uint32_t offset;
+
+	#define XHD_CACHE_ACTION ( (xhd_cache_action_t*) ( buf->data + action_offset ) )
+
+	if ( action->next_name != NULL )
+	{
+		if ( ( offset = xhd_cache_put_string( buf, action->next_name ) ) == 0 )
+			return -ENOMEM;
+
+		XHD_CACHE_ACTION->next_name = offset;
+	}
+
+	if ( action->name != NULL )
+	{
+		if ( ( offset = xhd_cache_put_string( buf, action->name ) ) == 0 )
+			return -ENOMEM;
+
+		XHD_CACHE_ACTION->name = offset;
+	}
+
+	XHD_CACHE_ACTION->exec      = action->exec;
+	XHD_CACHE_ACTION->repeat    = action->repeat;
+	XHD_CACHE_ACTION->repeat_ms = action->repeat_ms;
+
+	uint32_t cmds = xhd_cache_reserve( buf, sizeof(uint32_t) * ( action->num_cmds + 1 ) );
+
+	if ( cmds == 0 )
+		return -ENOMEM;
+
+	XHD_CACHE_ACTION->num_cmds = action->num_cmds;
+	XHD_CACHE_ACTION->cmds     = cmds;
+
+	for ( i = 0; i < action->num_cmds; ++i )
+	{
+		if ( ( offset = xhd_cache_put_string( buf, action->cmds[i]->line ) ) == 0 )
+			return -ENOMEM;
+
+		( (uint32_t*) ( buf->data + cmds ) )[i] = offset;
+	}
+
+	#undef XHD_CACHE_ACTION
+
+	return 0;
+}
+
+/**
+ * XHD Cache Build Mode Function
+ *
+ * Serializes one mode into the buffer
+ */
+static
+int xhd_cache_build_mode ( xhd_cache_buf_t* buf, uint32_t mode_offset, const xhd_mode_t* mode )
+{
+	int      ret = -ENOMEM;
+	uint32_t i, j, e;
+	uint32_t offset;
+	uint32_t num_bindings = 0;
+	uint32_t num_actions  = 0;
+	xhd_action_t** actions = NULL;
+
+	#define XHD_CACHE_MODE ( (xhd_cache_mode_t*) ( buf->data + mode_offset ) )
+
+	if ( ( offset = xhd_cache_put_string( buf, mode->name ) ) == 0 )
+		goto exit;
+
+	XHD_CACHE_MODE->name = offset;
+	XHD_CACHE_MODE->root = mode->root;
+
+	for ( i = 0; i < MAX_GROUPS; ++i )
+	{
+		if ( ( offset = xhd_cache_reserve( buf, sizeof(xhd_grab_t) * mode->grabs[i].num_grabs ) ) == 0 )
+			goto exit;
+
+		memcpy( buf->data + offset, mode->grabs[i].list, sizeof(xhd_grab_t) * mode->grabs[i].num_grabs );
+		XHD_CACHE_MODE->num_grabs[i] = mode->grabs[i].num_grabs;
+		XHD_CACHE_MODE->grabs[i]     = offset;
+	}
+
+	// Collect the distinct actions, every binding has exactly one slot
+	for ( i = 0; i < XHD_NUM_KEYS; ++i )
+		num_bindings += mode->keymap.keys[i].num_acts;
+
+	actions = (xhd_action_t**) malloc( sizeof(xhd_action_t*) * ( num_bindings + mode->num_named + 1 ) );
+
+	if ( actions == NULL )
+		goto exit;
+
+	for ( i = 0; i < XHD_NUM_KEYS; ++i )
+	{
+		for ( j = 0; j < mode->keymap.keys[i].num_acts; ++j )
+			actions[ num_actions++ ] = mode->keymap.keys[i].acts[j];
+	}
+
+	// Named actions need not be bound to any key of this keyboard map
+	for ( i = 0; i < mode->num_named; ++i )
+		actions[ num_actions++ ] = mode->named[i];
+
+	qsort( actions, num_actions, sizeof(xhd_action_t*), xhd_cache_compare_action );
+
+	for ( i = 0, j = 0; i < num_actions; ++i )
+	{
+		if ( j == 0 || actions[ j - 1 ] != actions[i] )
+			actions[ j++ ] = actions[i];
+	}
+
+	num_actions = j;
+
+	uint32_t cactions = xhd_cache_reserve( buf, sizeof(xhd_cache_action_t) * num_actions );
+
+	if ( cactions == 0 )
+		goto exit;
+
+	XHD_CACHE_MODE->num_actions = num_actions;
+	XHD_CACHE_MODE->actions     = cactions;
+
+	for ( i = 0; i < num_actions; ++i )
+	{
+		if ( xhd_cache_build_action( buf, cactions + i * sizeof(xhd_cache_action_t), actions[i] ) )
+			goto exit;
+	}
+
+	uint32_t bindings = xhd_cache_reserve( buf, sizeof(xhd_cache_binding_t) * num_bindings );
+
+	if ( bindings == 0 )
+		goto exit;
+
+	XHD_CACHE_MODE->num_bindings = num_bindings;
+	XHD_CACHE_MODE->bindings     = bindings;
+
+	for ( i = 0; i < XHD_NUM_KEYS; ++i )
+	{
+		const xhd_key_t* key = &mode->keymap.keys[i];
+
+		for ( e = 0; e < XHD_NUM_EVENTS; ++e )
+		{
+			const uint8_t* slots = key->slots[e];
+
+			if ( slots == NULL )
+				continue;
+
+			for ( j = 0; j < XHD_NUM_MODIFIERS; ++j )
+			{
+				if ( slots[j] == 0 )
+					continue;
+
+				xhd_action_t**       action  = (xhd_action_t**) bsearch( &key->acts[ slots[j] - 1 ], actions, num_actions,
+				                                                          sizeof(xhd_action_t*), xhd_cache_compare_action );
+				xhd_cache_binding_t* binding = (xhd_cache_binding_t*) ( buf->data + bindings );
+
+				binding->key_index = i;
+				binding->event     = e;
+				binding->mod       = j;
+				binding->action    = action - actions;
+
+				bindings += sizeof(xhd_cache_binding_t);
+			}
+		}
+	}
+
+	uint32_t named = xhd_cache_reserve( buf, sizeof(uint32_t) * ( mode->num_named + 1 ) );
+
+	if ( named == 0 )
+		goto exit;
+
+	XHD_CACHE_MODE->num_named = mode->num_named;
+	XHD_CACHE_MODE->named     = named;
+
+	for ( i = 0; i < mode->num_named; ++i )
+	{
+		xhd_action_t** action = (xhd_action_t**) bsearch( &mode->named[i], actions, num_actions,
+		                                                  sizeof(xhd_action_t*), xhd_cache_compare_action );
+
+		( (uint32_t*) ( buf->data + named ) )[i] = action - actions;
+	}
+
+	#undef XHD_CACHE_MODE
+
+	ret = 0;
+
+	exit:
+		free( actions );
+		return ret;
+}
+
+/**
+ * XHD Cache Write Function
+ *
+ * Compiles a loaded modelist into a cache file
+ * The file is written aside and renamed into place
+ */
+int xhd_cache_write ( const xhd_modelist_t* modelist, const char* cache_path, uint64_t config_hash, uint64_t keymap_hash )
+{
+	uint32_t i;
+	int      ret = 0;
+	char     tmp_path[ 4096 ];
+	char     dir[ 4096 ];
+	xhd_cache_buf_t buf = { NULL, 0, 0, 0, 0, NULL };
+
+	uint32_t header = xhd_cache_reserve( &buf, sizeof(xhd_cache_header_t) );
+	uint32_t modes  = xhd_cache_reserve( &buf, sizeof(xhd_cache_mode_t) * modelist->num_modes );
+
+	if ( buf.data == NULL || modes == 0 )
+	{
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for ( i = 0; i < modelist->num_modes; ++i )
+	{
+		ret = xhd_cache_build_mode( &buf, modes + i * sizeof(xhd_cache_mode_t), &modelist->modes[i] );
+
+		if ( ret )
+			goto exit;
+	}
+
+	xhd_cache_header_t* hdr = (xhd_cache_header_t*) ( buf.data + header );
+	hdr->magic       = XHD_CACHE_MAGIC;
+	hdr->version     = XHD_CACHE_VERSION;
+	hdr->config_hash = config_hash;
+	hdr->keymap_hash = keymap_hash;
+	hdr->max_groups  = MAX_GROUPS;
+	hdr->max_keycode = MAX_KEYCODE;
+	hdr->max_levels  = MAX_LEVELS;
+	hdr->size        = buf.len;
+	hdr->num_modes   = modelist->num_modes;
+	hdr->modes       = modes;
+
+	// Create the cache directory, one level is enough for xhd/
+	snprintf( dir, sizeof(dir), "%s", cache_path );
+
+	char* slash = strrchr( dir, '/' );
+
+	if ( slash != NULL && slash != dir )
+	{
+		*slash = '\0';
+		mkdir( dir, 0700 );
+	}
+
+	snprintf( tmp_path, sizeof(tmp_path), "%s.%d", cache_path, (int) getpid() );
+
+	int fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+
+	if ( fd < 0 )
+	{
+		ret = -errno;
+		goto exit;
+	}
+
+	if ( write( fd, buf.data, buf.len ) != (ssize_t) buf.len || fsync( fd ) )
+	{
+		ret = -errno;
+		close( fd );
+		unlink( tmp_path );
+		goto exit;
+	}
+
+	close( fd );
+
+	if ( rename( tmp_path, cache_path ) )
+	{
+		ret = -errno;
+		unlink( tmp_path );
+	}
+
+	exit:
+		if ( ret )
+			fprintf( stderr, "Failed to write cache %s: %s\n", cache_path, strerror( -ret ) );
+
+		free( buf.strings );
+		free( buf.data );
+		return ret;
+}
+
+/**
+ * XHD Cache At Function
+ *
+ * Bounds checks an array of count elements at an offset into the mapped cache
+ * The count is checked before it is multiplied, so it cannot wrap
+ */
+static inline
+const void* xhd_cache_at ( const char* map, uint32_t size, uint32_t offset, size_t count, size_t elem )
+{
+	if ( offset == 0 || offset > size || count > ( size - offset ) / elem )
+		return NULL;
+
+	return map + offset;
+}
+
+static inline
+const char* xhd_cache_string ( const char* map, uint32_t size, uint32_t offset )
+{
+	const char* str = (const char*) xhd_cache_at( map, size, offset, 1, 1 );
+
+	if ( str == NULL || memchr( str, '\0', size - offset ) == NULL )
+		return NULL;
+
+	return str;
+}
+
+/**
+ * XHD Cache Load Mode Function
+ *
+ * Registers one cached mode into a modelist
+ */
+static
+int xhd_cache_load_mode ( xhd_modelist_t* modelist, const char* map, uint32_t size, const xhd_cache_mode_t* cmode )
+{
+	uint32_t i, j;
+	const char* name = xhd_cache_string( map, size, cmode->name );
+
+	if ( name == NULL || xhd_modes_register_mode( modelist, name, strlen( name ) ) )
+		return -1;
+
+	xhd_mode_t* mode = &modelist->modes[ modelist->num_modes - 1 ];
+
+	// Sequences start in a mode written before their nodes
+	if ( cmode->root != XHD_NO_MODE
+	     && ( cmode->root >= modelist->num_modes - 1 || modelist->modes[ cmode->root ].root != XHD_NO_MODE ) )
+		return -1;
+
+	mode->root = cmode->root;
+
+	// Grablists are stored sorted and unique, so they copy straight in
+	// Grab diffs rely on that, so a list that is not is corrupt
+	for ( i = 0; i < MAX_GROUPS; ++i )
+	{
+		const xhd_grab_t* grabs = (const xhd_grab_t*) xhd_cache_at( map, size, cmode->grabs[i], cmode->num_grabs[i], sizeof(xhd_grab_t) );
+
+		if ( grabs == NULL && cmode->num_grabs[i] != 0 )
+			return -1;
+
+		for ( j = 1; j < cmode->num_grabs[i]; ++j )
+		{
+			if ( xhd_modes_grab_key( &grabs[ j - 1 ] ) >= xhd_modes_grab_key( &grabs[j] ) )
+				return -1;
+		}
+
+		if ( mode->grabs[i].alloc_grabs < cmode->num_grabs[i] )
+		{
+			mode->grabs[i].list = (xhd_grab_t*) xhd_arena_alloc( &modelist->arena, sizeof(xhd_grab_t) * cmode->num_grabs[i] );
+
+			if ( mode->grabs[i].list == NULL )
+				return -ENOMEM;
+
+			mode->grabs[i].alloc_grabs = cmode->num_grabs[i];
+		}
+
+		if ( cmode->num_grabs[i] != 0 )
+			memcpy( mode->grabs[i].list, grabs, sizeof(xhd_grab_t) * cmode->num_grabs[i] );
+
+		mode->grabs[i].num_grabs = cmode->num_grabs[i];
+	}
+
+	const xhd_cache_action_t*  cactions = (const xhd_cache_action_t*) xhd_cache_at( map, size, cmode->actions, cmode->num_actions, sizeof(xhd_cache_action_t) );
+	const xhd_cache_binding_t* bindings = (const xhd_cache_binding_t*) xhd_cache_at( map, size, cmode->bindings, cmode->num_bindings, sizeof(xhd_cache_binding_t) );
+
+	if ( ( cactions == NULL && cmode->num_actions != 0 ) || ( bindings == NULL && cmode->num_bindings != 0 ) )
+		return -1;
+
+	xhd_action_t** actions = (xhd_action_t**) xhd_arena_alloc( &modelist->arena, sizeof(xhd_action_t*) * ( cmode->num_actions + 1 ) );
+
+	if ( actions == NULL )
+		return -ENOMEM;
+
+	for ( i = 0; i < cmode->num_actions; ++i )
+	{
+		const xhd_cache_action_t* caction = &cactions[i];
+		const uint32_t* cmds = (const uint32_t*) xhd_cache_at( map, size, caction->cmds, caction->num_cmds, sizeof(uint32_t) );
+
+		if ( cmds == NULL || caction->exec > XHD_EXEC_SINGLE_SHELL || caction->repeat > XHD_REPEAT_COALESCE
+		     || ( actions[i] = xhd_modes_new_action( modelist ) ) == NULL )
+			return -1;
+
+		// Single shell commands were already joined by the writer
+		actions[i]->exec      = caction->exec;
+		actions[i]->repeat    = caction->repeat;
+		actions[i]->repeat_ms = caction->repeat_ms;
+
+		if ( caction->next_name != 0 )
+		{
+			const char* next_name = xhd_cache_string( map, size, caction->next_name );
+
+			if ( next_name == NULL || ( actions[i]->next_name = xhd_arena_strdup( &modelist->arena, next_name ) ) == NULL )
+				return -1;
+		}
+
+		if ( caction->name != 0 )
+		{
+			const char* action_name = xhd_cache_string( map, size, caction->name );
+
+			if ( action_name == NULL || ( actions[i]->name = xhd_arena_strdup( &modelist->arena, action_name ) ) == NULL )
+				return -1;
+		}
+
+		for ( j = 0; j < caction->num_cmds; ++j )
+		{
+			const char* cmd = xhd_cache_string( map, size, cmds[j] );
+
+			if ( cmd == NULL || xhd_modes_register_command( modelist, actions[i], cmd, strlen( cmd ) ) )
+				return -1;
+		}
+	}
+
+	for ( i = 0; i < cmode->num_bindings; ++i )
+	{
+		const xhd_cache_binding_t* binding = &bindings[i];
+
+		if ( binding->key_index >= XHD_NUM_KEYS || binding->event >= XHD_NUM_EVENTS
+		     || binding->mod >= XHD_NUM_MODIFIERS || binding->action >= cmode->num_actions
+		     || xhd_modes_register_action( &modelist->arena, &mode->keymap, binding->key_index, binding->event,
+		                                   binding->mod, actions[ binding->action ] ) )
+			return -1;
+	}
+
+	const uint32_t* named = (const uint32_t*) xhd_cache_at( map, size, cmode->named, cmode->num_named, sizeof(uint32_t) );
+
+	if ( named == NULL && cmode->num_named != 0 )
+		return -1;
+
+	for ( i = 0; i < cmode->num_named; ++i )
+	{
+		if ( named[i] >= cmode->num_actions || actions[ named[i] ]->name == NULL
+		     || xhd_modes_register_name( &modelist->arena, mode, actions[ named[i] ] ) )
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Cache Load Function
+ *
+ * Loads a modelist from a cache file, if it is still valid
+ * Returns 0 on success; on failure the modelist may be partially filled
+ */
+int xhd_cache_load ( xhd_modelist_t* modelist, const char* cache_path, uint64_t config_hash, uint64_t keymap_hash )
+{
+	int ret = -1;
+	uint32_t i;
+	struct stat st;
+
+	int fd = open( cache_path, O_RDONLY | O_CLOEXEC );
+
+	if ( fd < 0 )
+		return -1;
+
+	if ( fstat( fd, &st ) || st.st_size < (off_t) sizeof(xhd_cache_header_t) || st.st_size > UINT32_MAX )
+	{
+		close( fd );
+		return -1;
+	}
+
+	const char* map = (const char*) mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+
+	if ( map == MAP_FAILED )
+		return -1;
+
+	const xhd_cache_header_t* hdr = (const xhd_cache_header_t*) map;
+	uint32_t size = (uint32_t) st.st_size;
+
+	if ( hdr->magic != XHD_CACHE_MAGIC
+	     || hdr->version != XHD_CACHE_VERSION
+	     || hdr->config_hash != config_hash
+	     || hdr->keymap_hash != keymap_hash
+	     || hdr->max_groups != MAX_GROUPS
+	     || hdr->max_keycode != MAX_KEYCODE
+	     || hdr->max_levels != MAX_LEVELS
+	     || hdr->size != size
+	     || hdr->num_modes == 0 )
+		goto exit;
+
+	const xhd_cache_mode_t* modes = (const xhd_cache_mode_t*) xhd_cache_at( map, size, hdr->modes, hdr->num_modes, sizeof(xhd_cache_mode_t) );
+
+	if ( modes == NULL )
+		goto exit;
+
+	for ( i = 0; i < hdr->num_modes; ++i )
+	{
+		if ( xhd_cache_load_mode( modelist, map, size, &modes[i] ) )
+		{
+			fprintf( stderr, "Cache %s is corrupt, ignoring it.\n", cache_path );
+			goto exit;
+		}
+	}
+
+	modelist->cur_mode = 0;
+	ret = xhd_modes_finalize( modelist );
+
+	exit:
+		munmap( (void*) map, size );
+		return ret;
+}
+
+#endif
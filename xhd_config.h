@@ -1,7 +1,6 @@
 // TODO
 // Add Escape Characters
 // Add Comments
-// Add multi-key lines
 
 #ifndef XHD_PARSE_LIB_H
 #define XHD_PARSE_LIB_H
@@ -10,28 +9,41 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include "xhd_modes.h"
+#include "xhd_cache.h"
 #include "xhd_config.h"
 
-#define MAXBUFLEN	512
-#define MAXCOMBOLEN	8
-#define MAXKEYLEN	40
-#define MAXNAMELEN	40
-#define MAXFLAGLEN	40
-#define MAXCMDLEN	256
-#define DEFAULTCMDS 4
+/**
+ * A Token
+ *
+ * A view into the mapped config, not NUL terminated
+ */
+typedef struct xhd_token_t
+{
+	const char* str;
+	uint32_t    len;
+
+} xhd_token_t;
 
 /**
  * Parser State Object
+ *
+ * The whole config is mapped, tokens point into it
  */
 typedef struct parser_t
 {
-	FILE*    config;
-	uint32_t lines_read;
-	uint32_t buffer_index;
-	uint32_t buffer_len;
-	char     buffer[ MAXBUFLEN + 1 ];
+	const char* data;			// The mapped config
+	size_t      len;			// Its length
+	size_t      pos;			// The next character
+	uint32_t    line;			// The line of pos, from 1
+	size_t      line_start;		// The offset of that line
 
 	xhd_modelist_t* modelist;
 
@@ -39,21 +51,37 @@ typedef struct parser_t
 
 //* config_file = mode_entry | config_file, mode_entry ;
 //* mode_entry = mode_name, '{', hotkey_list, '}' ;
-//* mode_name = STRING_NO_WHITESPACE
+//* mode_name = STRING_NO_WHITESPACE, without '/'
 //* hotkey_list = hotkey_entry | hotkey_list, hotkey_entry ;
-//* hotkey_entry = keycombo, [flag_list], '{', command_list, '}' ;
+//* hotkey_entry = key_sequence, [flag_list], '{', command_list, '}' ;
+//* key_sequence = keycombo | key_sequence, ';', keycombo ;
 //* keycombo = { modifier, "+" }, keysym ;
 //* modifier = "shift" | "lock" | "ctrl" | "mod1" | "mod2" | "mod3" | "mod4" | "mod5" ;
 //* keysym = STRING_NO_WHITESPACE
 //* flag_list = flag | flag_list, flag ;
-//* flag = "--", STRING_NO_WHITESPACE ;
+//* flag = "--", STRING_NO_WHITESPACE, [ flag_argument ] ;
+//* flag_argument = STRING_NO_WHITESPACE ;
+//*
+//* Flags:
+//*   --mode NAME         switch to mode NAME after running the commands
+//*   --name NAME         run the action over the control socket by NAME
+//*   --release           run on key release instead of press
+//*   --norepeat          ignore auto-repeated presses
+//*   --repeat-rate N     run at most N times a second while held
+//*   --coalesce          skip repeats while a previous run is still running
+//*   --parallel          start every command at once (the default)
+//*   --serial            start each command once the previous one succeeded
+//*   --single-shell      run the command list as one shell script
 //* command_list = command | command_list, NEWLINE, command ;
-//* command = STRING
+//* command = STRING | "@", builtin, [ STRING ] | "@", plugin, ":", handler, [ STRING ] ;
+//*
+//* Key sequence prefixes become modes named by their path, e.g. default/mod4+x
 
 static inline
-void xhd_config_print_error ( parser_t* parser )
+void xhd_config_print_error ( const parser_t* parser )
 {
-	fprintf ( stderr, "Config parse error on line %d.\n", parser->lines_read );
+	fprintf( stderr, "Config parse error on line %u, column %u.\n",
+	         parser->line, (uint32_t) ( parser->pos - parser->line_start ) + 1 );
 }
 
 static inline
@@ -65,79 +93,49 @@ int xhd_config_is_whitespace ( char c )
 static inline
 int xhd_config_is_next ( parser_t* parser )
 {
-	return ! feof( parser->config ) || parser->buffer_index < parser->buffer_len;
+	return parser->pos < parser->len;
 }
 
 static inline
-int xhd_config_read_to_buf ( parser_t* parser )
+char xhd_config_get_char ( parser_t* parser )
 {
-	if ( parser->config == NULL )
-	{
-		fprintf( stderr, "Error reading file.\n" );
-		return -1;
-	}
-
-	if ( feof( parser->config ) )
-	{
-		fprintf( stderr, "Unexpected end-of-file.\n" );
-		return -1;
-	}
-
-	uint32_t newLen = fread( parser->buffer, sizeof(char), MAXBUFLEN, parser->config );
-
-	if ( ferror( parser->config ) != 0 )
-	{
-		fprintf( stderr, "Error reading file.\n" );
-		return -1;
-	}
-
-	parser->buffer_index = 0;
-	parser->buffer_len   = newLen;
-
-	parser->buffer[ newLen++ ] = '\0';
+	return xhd_config_is_next( parser ) ? parser->data[ parser->pos ] : '\0';
 }
 
 static inline
 char xhd_config_read_char ( parser_t* parser )
 {
-	if ( parser->buffer_index >= parser->buffer_len )
-	{
-		if ( xhd_config_read_to_buf( parser ) )
-			return 0;
-	}
+	if ( ! xhd_config_is_next( parser ) )
+		return '\0';
 
-	char c = parser->buffer[ parser->buffer_index++ ];
+	char c = parser->data[ parser->pos++ ];
 
 	if ( c == '\n' )
-		parser->lines_read++;
-
-	return c;
-}
-
-static inline
-char xhd_config_get_char ( parser_t* parser )
-{
-	if ( parser->buffer_index >= parser->buffer_len )
 	{
-		if ( xhd_config_read_to_buf( parser ) )
-			return 0;
+		parser->line++;
+		parser->line_start = parser->pos;
 	}
 
-	return parser->buffer[ parser->buffer_index ];
+	return c;
 }
 
 static inline
 int xhd_config_expect ( parser_t* parser, char c )
 {
-	char d = xhd_config_read_char( parser );
+	char d = xhd_config_get_char( parser );
 
 	if ( c != d )
 	{
-		fprintf( stderr, "Expected: %c, Got: %c\n", c, d );
+		if ( xhd_config_is_next( parser ) )
+			fprintf( stderr, "Expected: %c, Got: %c\n", c, d );
+		else
+			fprintf( stderr, "Expected: %c, Got: end of file\n", c );
+
 		xhd_config_print_error( parser );
 		return -1;
 	}
 
+	xhd_config_read_char( parser );
 	return 0;
 }
 
@@ -145,7 +143,7 @@ static inline
 int xhd_config_trim_whitespace ( parser_t* parser )
 {
 	while ( xhd_config_is_next( parser )
-	       	&& xhd_config_is_whitespace( xhd_config_get_char( parser ) ) )
+	        && xhd_config_is_whitespace( xhd_config_get_char( parser ) ) )
 	{
 		xhd_config_read_char( parser );
 	}
@@ -154,36 +152,50 @@ int xhd_config_trim_whitespace ( parser_t* parser )
 }
 
 static inline
-xhd_modifier_t xhd_config_parse_modifier ( const char* modifier )
-{
-	if ( strncasecmp( modifier, "shift", 5 ) == 0 )
-		return 1 << 0;
-	if ( strncasecmp( modifier, "lock", 4 ) == 0 )
-		return 1 << 1;
-	if ( strncasecmp( modifier, "ctrl", 4 ) == 0 )
-		return 1 << 2;
-	if ( strncasecmp( modifier, "mod1", 4 ) == 0 )
-		return 1 << 3;
-	if ( strncasecmp( modifier, "mod2", 4 ) == 0 )
-		return 1 << 4;
-	if ( strncasecmp( modifier, "mod3", 4 ) == 0 )
-		return 1 << 5;
-	if ( strncasecmp( modifier, "mod4", 4 ) == 0 )
-		return 1 << 6;
-	if ( strncasecmp( modifier, "mod5", 4 ) == 0 )
-		return 1 << 7;
+int xhd_config_token_is ( const xhd_token_t* token, const char* str )
+{
+	return strlen( str ) == token->len && memcmp( token->str, str, token->len ) == 0;
+}
+
+// Modifier names, in bit order
+static const char* xhd_config_modifiers[] = { "shift", "lock", "ctrl", "mod1", "mod2", "mod3", "mod4", "mod5" };
+
+#define XHD_CONFIG_NUM_MODIFIERS ( sizeof(xhd_config_modifiers) / sizeof(xhd_config_modifiers[0]) )
+
+static inline
+xhd_modifier_t xhd_config_parse_modifier ( const xhd_token_t* modifier )
+{
+	uint32_t i;
+
+	for ( i = 0; i < XHD_CONFIG_NUM_MODIFIERS; ++i )
+	{
+		const char* name = xhd_config_modifiers[i];
+
+		if ( strlen( name ) == modifier->len && strncasecmp( modifier->str, name, modifier->len ) == 0 )
+			return 1 << i;
+	}
+
 	return -1;
 }
 
 static inline
-xkb_keysym_t xhd_config_parse_keysym ( parser_t* parser, const char* keystring )
+xkb_keysym_t xhd_config_parse_keysym ( const xhd_token_t* keystring, uint32_t line )
 {
-	xkb_keysym_t keysym = xkb_keysym_from_name( keystring, XKB_KEYSYM_CASE_INSENSITIVE );
+	// Keysym names are short, a longer token cannot name one
+	char         name[ 64 ];
+	xkb_keysym_t keysym = 0;
+
+	if ( keystring->len < sizeof(name) )
+	{
+		memcpy( name, keystring->str, keystring->len );
+		name[ keystring->len ] = '\0';
+		keysym = xkb_keysym_from_name( name, XKB_KEYSYM_CASE_INSENSITIVE );
+	}
 
 	if ( keysym == 0 )
 	{
-		fprintf( stderr, "Failed to translate key: %s\n", keystring );
-		return -1;
+		fprintf( stderr, "Failed to translate key %.*s on line %u\n", (int) keystring->len, keystring->str, line );
+		return 0;
 	}
 
 	return keysym;
@@ -191,104 +203,228 @@ xkb_keysym_t xhd_config_parse_keysym ( parser_t* parser, const char* keystring )
 
 int xhd_config_parse_keycombo ( parser_t* parser, xkb_keysym_t* keysym, xhd_modifier_t* modifier )
 {
-	char     c;
-	char     key_buf[MAXCOMBOLEN][MAXKEYLEN];
-	uint32_t key_index = 0;
-	uint32_t chr_index = 0;
+	char        c;
+	int         ended = 0;
+	xhd_token_t piece = { parser->data + parser->pos, 0 };
+	uint32_t    line  = parser->line;
 
-	memset( key_buf[ key_index ], 0, MAXKEYLEN );
+	*modifier = 0;
 
-	// Split the combo into pieces stored in key_buf
+	// Pieces are separated by '+', the last one is the keysym
 	while ( 1 )
 	{
-		if ( chr_index >= MAXKEYLEN - 1 )
+		c = xhd_config_get_char( parser );
+
+		if ( ! xhd_config_is_next( parser ) )
 		{
+			fprintf( stderr, "Unexpected end of file in key combo\n" );
 			xhd_config_print_error( parser );
 			return -1;
 		}
-
-		// Get next character
-		c = xhd_config_read_char( parser );
-
-		if ( xhd_config_is_whitespace( c ) )
+		else if ( xhd_config_is_whitespace( c ) )
 		{
-			// Skip whitespaces
-			continue;
+			// Whitespace may surround the '+' signs
+			ended = piece.len != 0;
 		}
 		else if ( c == '+' )
 		{
-			// Start reading next modifier
-			key_index++;
-			chr_index = 0;
-			memset( key_buf[key_index], 0, MAXKEYLEN );
-			continue;
+			xhd_modifier_t tmp = xhd_config_parse_modifier( &piece );
+
+			if ( tmp == (xhd_modifier_t) -1 )
+			{
+				fprintf( stderr, "Failed parsing modifier: %.*s\n", (int) piece.len, piece.str );
+				xhd_config_print_error( parser );
+				return -1;
+			}
+
+			*modifier |= tmp;
+			piece.len  = 0;
+			ended      = 0;
 		}
-		else if ( c == '-' || c == '{' )
+		else if ( c == '-' || c == '{' || c == ';' )
 		{
 			// End State
-			parser->buffer_index--;
 			break;
 		}
+		else
+		{
+			if ( ended )
+			{
+				fprintf( stderr, "Expected + between keys\n" );
+				xhd_config_print_error( parser );
+				return -1;
+			}
+
+			if ( piece.len == 0 )
+			{
+				piece.str = parser->data + parser->pos;
+				line      = parser->line;
+			}
+
+			piece.len++;
+		}
 
-		key_buf[ key_index ][ chr_index++ ] = c;
+		xhd_config_read_char( parser );
 	}
 
-	// Parse the key_buf into modifiers
-	*modifier = 0;
+	if ( piece.len == 0 )
+	{
+		fprintf( stderr, "Missing key in key combo\n" );
+		xhd_config_print_error( parser );
+		return -1;
+	}
+
+	*keysym = xhd_config_parse_keysym( &piece, line );
 
-	int i;
-	for ( i = 0; i < key_index; ++i )
+	// A misspelled key fails the whole config, so a reload keeps the running one
+	if ( *keysym == 0 )
+		return -1;
+
+	return 0;
+}
+
+int xhd_config_parse_word ( parser_t* parser, xhd_token_t* word )
+{
+	word->str = parser->data + parser->pos;
+	word->len = 0;
+
+	while ( xhd_config_is_next( parser ) )
 	{
-		xhd_modifier_t tmp = xhd_config_parse_modifier( key_buf[i] );
+		char c = xhd_config_get_char( parser );
 
-		if ( tmp == (xhd_modifier_t) -1 )
-		{
-			fprintf( stderr, "Failed parsing modifier: %s\n", key_buf[i] );
-			return -1;
-		}
+		if ( xhd_config_is_whitespace( c ) || c == '{' )
+			break;
 
-		*modifier |= tmp;
+		xhd_config_read_char( parser );
+		word->len++;
 	}
 
-	*keysym = xhd_config_parse_keysym( parser, key_buf[ key_index ] );
-
 	return 0;
 }
 
-int xhd_config_parse_flag ( parser_t* parser )
+int xhd_config_parse_flag_arg ( parser_t* parser, const xhd_token_t* flag, char** arg )
 {
-	char     c;
-	char     flag_buf[ MAXFLAGLEN ];
-	uint32_t flag_index = 0;
+	xhd_token_t word;
+
+	xhd_config_trim_whitespace( parser );
 
-	memset( flag_buf, 0, MAXFLAGLEN );
+	if ( xhd_config_parse_word( parser, &word ) )
+		return -1;
 
-	while ( 1 )
+	if ( word.len == 0 )
 	{
-		if ( flag_index >= MAXFLAGLEN - 1 )
-		{
-			xhd_config_print_error( parser );
-			return -1;
-		}
+		fprintf( stderr, "Flag --%.*s expects a name\n", (int) flag->len, flag->str );
+		xhd_config_print_error( parser );
+		return -1;
+	}
 
-		// Get next character
-		c = xhd_config_read_char( parser );
+	*arg = xhd_arena_strndup( &parser->modelist->arena, word.str, word.len );
+	return *arg == NULL ? -1 : 0;
+}
 
-		if ( xhd_config_is_whitespace( c ) || c == '{' )
-		{
-			// End State
-			parser->buffer_index--;
-			break;
-		}
+int xhd_config_parse_flag_number ( parser_t* parser, const xhd_token_t* flag, uint32_t min, uint32_t max, uint32_t* value )
+{
+	char          digits[ 16 ];
+	char*         end;
+	unsigned long number = 0;
+	xhd_token_t   word;
+
+	xhd_config_trim_whitespace( parser );
+
+	if ( xhd_config_parse_word( parser, &word ) )
+		return -1;
 
-		flag_buf[ flag_index++ ] = c;
+	if ( word.len != 0 && word.len < sizeof(digits) )
+	{
+		memcpy( digits, word.str, word.len );
+		digits[ word.len ] = '\0';
+		number = strtoul( digits, &end, 10 );
+	}
+
+	if ( word.len == 0 || word.len >= sizeof(digits) || *end != '\0' || number < min || number > max )
+	{
+		fprintf( stderr, "Flag --%.*s expects a number from %u to %u\n", (int) flag->len, flag->str, min, max );
+		xhd_config_print_error( parser );
+		return -1;
 	}
 
-	printf( "\t%s\n", flag_buf );
+	*value = (uint32_t) number;
 	return 0;
 }
 
-int xhd_config_parse_flag_list ( parser_t* parser )
+int xhd_config_parse_flag ( parser_t* parser, xhd_action_t* action, uint32_t* event )
+{
+	xhd_token_t flag;
+
+	if ( xhd_config_parse_word( parser, &flag ) )
+		return -1;
+
+	// The mode is resolved by name once every mode is parsed
+	if ( xhd_config_token_is( &flag, "mode" ) )
+		return xhd_config_parse_flag_arg( parser, &flag, &action->next_name );
+
+	// Lets the control socket run the action
+	if ( xhd_config_token_is( &flag, "name" ) )
+		return xhd_config_parse_flag_arg( parser, &flag, &action->name );
+
+	// Binds the action to letting go of the keys instead of pressing them
+	if ( xhd_config_token_is( &flag, "release" ) )
+	{
+		*event = XHD_EVENT_RELEASE;
+		return 0;
+	}
+
+	// How the commands are run
+	if ( xhd_config_token_is( &flag, "parallel" ) )
+	{
+		action->exec = XHD_EXEC_PARALLEL;
+		return 0;
+	}
+
+	if ( xhd_config_token_is( &flag, "serial" ) )
+	{
+		action->exec = XHD_EXEC_SERIAL;
+		return 0;
+	}
+
+	if ( xhd_config_token_is( &flag, "single-shell" ) )
+	{
+		action->exec = XHD_EXEC_SINGLE_SHELL;
+		return 0;
+	}
+
+	// Holding the keys down runs the action once
+	if ( xhd_config_token_is( &flag, "norepeat" ) )
+	{
+		action->repeat = XHD_REPEAT_NONE;
+		return 0;
+	}
+
+	// Holding the keys down runs the action again only once its commands are done
+	if ( xhd_config_token_is( &flag, "coalesce" ) )
+	{
+		action->repeat = XHD_REPEAT_COALESCE;
+		return 0;
+	}
+
+	// Holding the keys down runs the action at most N times a second
+	if ( xhd_config_token_is( &flag, "repeat-rate" ) )
+	{
+		uint32_t rate;
+
+		if ( xhd_config_parse_flag_number( parser, &flag, 1, 1000, &rate ) )
+			return -1;
+
+		action->repeat_ms = 1000 / rate;
+		return 0;
+	}
+
+	fprintf( stderr, "Unknown flag: --%.*s\n", (int) flag.len, flag.str );
+	xhd_config_print_error( parser );
+	return -1;
+}
+
+int xhd_config_parse_flag_list ( parser_t* parser, xhd_action_t* action, uint32_t* event )
 {
 	xhd_config_trim_whitespace( parser );
 
@@ -300,7 +436,7 @@ int xhd_config_parse_flag_list ( parser_t* parser )
 		if ( xhd_config_expect( parser, '-' ) )
 			return -1;
 
-		if ( xhd_config_parse_flag( parser ) )
+		if ( xhd_config_parse_flag( parser, action, event ) )
 			return -1;
 
 		xhd_config_trim_whitespace( parser );
@@ -308,61 +444,69 @@ int xhd_config_parse_flag_list ( parser_t* parser )
 	return 0;
 }
 
-int xhd_config_parse_command ( parser_t* parser, char* cmd_buf )
+int xhd_config_parse_command ( parser_t* parser, xhd_token_t* cmd )
 {
-	char     c;
-	uint32_t cmd_index = 0;
+	char c;
 
-	memset( cmd_buf, 0, MAXCMDLEN );
+	cmd->str = parser->data + parser->pos;
+	cmd->len = 0;
 
 	while ( 1 )
 	{
-		if ( cmd_index >= MAXCMDLEN - 1 )
+		if ( ! xhd_config_is_next( parser ) )
 		{
+			fprintf( stderr, "Unexpected end of file in command\n" );
 			xhd_config_print_error( parser );
 			return -1;
 		}
 
-		// Get next character
-		c = xhd_config_read_char( parser );
+		c = xhd_config_get_char( parser );
 
-		if ( c == '\r' )
+		if ( c == '}' )
 		{
-			// Skip carriage return
-			continue;
-		}
-		else if ( c == '\n' )
-		{
-			// End State
-			// Swallow the new line
+			// End State, left for the command list
 			break;
 		}
-		else if ( c == '}' )
+
+		xhd_config_read_char( parser );
+
+		if ( c == '\n' )
 		{
 			// End State
-			parser->buffer_index--;
+			// Swallow the new line
 			break;
 		}
 
-		cmd_buf[ cmd_index++ ] = c;
+		cmd->len++;
 	}
 
+	// Drop carriage returns and trailing blanks
+	while ( cmd->len != 0 && xhd_config_is_whitespace( cmd->str[ cmd->len - 1 ] ) )
+		cmd->len--;
+
 	return 0;
 }
 
 int xhd_config_parse_command_list ( parser_t* parser, xhd_action_t* action )
 {
-	char cmd_buf[ MAXCMDLEN ];
+	xhd_token_t cmd;
 
 	xhd_config_trim_whitespace( parser );
 
 	while ( xhd_config_get_char( parser ) != '}' )
 	{
-		if ( xhd_config_parse_command( parser, cmd_buf ) )
+		uint32_t line   = parser->line;
+		uint32_t column = (uint32_t) ( parser->pos - parser->line_start ) + 1;
+
+		if ( xhd_config_parse_command( parser, &cmd ) )
 			return -1;
 
-		if ( xhd_modes_register_command( action, cmd_buf ) )
+		// Builtins are checked as they are registered
+		if ( cmd.len != 0 && xhd_modes_register_command( parser->modelist, action, cmd.str, cmd.len ) )
+		{
+			fprintf( stderr, "Config parse error on line %u, column %u.\n", line, column );
 			return -1;
+		}
 
 		xhd_config_trim_whitespace( parser );
 	}
@@ -370,34 +514,153 @@ int xhd_config_parse_command_list ( parser_t* parser, xhd_action_t* action )
 	return 0;
 }
 
+/**
+ * XHD Config Sequence Node Function
+ *
+ * Returns the mode a key combo in a key sequence leads to from parent,
+ * creating it and binding the combo to enter it the first time
+ * at is where the combo starts, for errors
+ */
+uint32_t xhd_config_sequence_node ( parser_t* parser, const parser_t* at, uint32_t parent, xkb_keysym_t keysym, xhd_modifier_t modifier )
+{
+	char     name[ 1024 ];
+	char     symbol[ 64 ];
+	uint32_t i;
+	int      len;
+
+	xhd_modelist_t* modelist = parser->modelist;
+
+	// Nodes are named by their path, e.g. default/mod4+x, so equal prefixes share one
+	len = snprintf( name, sizeof(name), "%s/", modelist->modes[ parent ].name );
+
+	for ( i = 0; i < XHD_CONFIG_NUM_MODIFIERS && len < (int) sizeof(name); ++i )
+	{
+		if ( modifier & ( 1 << i ) )
+			len += snprintf( name + len, sizeof(name) - len, "%s+", xhd_config_modifiers[i] );
+	}
+
+	if ( xkb_keysym_get_name( keysym, symbol, sizeof(symbol) ) < 0 )
+		symbol[0] = '\0';
+
+	if ( len < (int) sizeof(name) )
+		len += snprintf( name + len, sizeof(name) - len, "%s", symbol );
+
+	if ( len >= (int) sizeof(name) )
+	{
+		fprintf( stderr, "Key sequence too long\n" );
+		xhd_config_print_error( parser );
+		return XHD_NO_MODE;
+	}
+
+	uint32_t      node  = xhd_modes_find_mode( modelist, name );
+	xhd_action_t* bound = xhd_modes_find_action( &modelist->modes[ parent ], keysym, modifier, XHD_EVENT_PRESS );
+
+	// Sequences sharing the prefix share the action entering it
+	if ( node != XHD_NO_MODE && bound != NULL && bound->next_name == modelist->modes[ node ].name )
+		return node;
+
+	if ( bound != NULL )
+	{
+		fprintf( stderr, "Key combo is already a hotkey, it cannot also start a key sequence\n" );
+		xhd_config_print_error( at );
+		return XHD_NO_MODE;
+	}
+
+	if ( node == XHD_NO_MODE )
+	{
+		if ( xhd_modes_register_mode( modelist, name, len ) )
+			return XHD_NO_MODE;
+
+		node = modelist->num_modes - 1;
+
+		xhd_mode_t* parent_mode = &modelist->modes[ parent ];
+		modelist->modes[ node ].root = parent_mode->root == XHD_NO_MODE ? parent : parent_mode->root;
+	}
+
+	// The combo enters the node
+	xhd_action_t* enter = xhd_modes_new_action( modelist );
+
+	if ( enter == NULL )
+		return XHD_NO_MODE;
+
+	enter->next_name = modelist->modes[ node ].name;
+
+	if ( xhd_modes_add_action( modelist, &modelist->modes[ parent ], keysym, modifier, XHD_EVENT_PRESS, enter ) )
+		return XHD_NO_MODE;
+
+	return node;
+}
+
+/**
+ * XHD Config Enters Node Function
+ *
+ * Whether an action is one xhd_config_sequence_node bound to enter a node
+ */
+static inline
+int xhd_config_enters_node ( const xhd_modelist_t* modelist, const xhd_action_t* action )
+{
+	uint32_t node = xhd_modes_find_mode( modelist, action->next_name );
+
+	return node != XHD_NO_MODE && modelist->modes[ node ].root != XHD_NO_MODE
+	       && modelist->modes[ node ].name == action->next_name;
+}
+
 int xhd_config_parse_hotkey_entry ( parser_t* parser )
 {
 	xkb_keysym_t   keysym   = 0;
 	xhd_modifier_t modifier = 0;
 
+	uint32_t mode_index = parser->modelist->cur_mode;
+	uint32_t event      = XHD_EVENT_PRESS;
+	parser_t combo      = *parser;		// Where the last combo starts, for errors
+
 	if ( xhd_config_parse_keycombo( parser, &keysym, &modifier ) )
 		return -1;
 
-	if ( xhd_config_parse_flag_list( parser ) )
+	// Every combo but the last of a sequence leads one node deeper
+	while ( xhd_config_get_char( parser ) == ';' )
+	{
+		xhd_config_read_char( parser );
+		xhd_config_trim_whitespace( parser );
+
+		mode_index = xhd_config_sequence_node( parser, &combo, mode_index, keysym, modifier );
+		combo      = *parser;
+
+		if ( mode_index == XHD_NO_MODE || xhd_config_parse_keycombo( parser, &keysym, &modifier ) )
+			return -1;
+	}
+
+	// Create new action, it lives as long as the modelist
+	xhd_action_t* action = xhd_modes_new_action( parser->modelist );
+
+	if ( action == NULL )
 		return -1;
 
-	// TODO: Add flag semantics
+	if ( xhd_config_parse_flag_list( parser, action, &event )
+	     || xhd_config_expect( parser, '{' )
+	     || xhd_config_parse_command_list( parser, action ) )
+		return -1;
 
-	if ( xhd_config_expect( parser, '{' ) )
+	if ( action->exec == XHD_EXEC_SINGLE_SHELL && xhd_modes_join_commands( parser->modelist, action ) )
 		return -1;
 
-	// Create new action
-	xhd_action_t action;
-	action.num_cmds   = 0;
-	action.alloc_cmds = 0;
-	action.cmds       = NULL;
-	action.mod        = modifier;
+	// A completed sequence returns to where it started, unless it has a --mode
+	xhd_mode_t*   mode  = &parser->modelist->modes[ mode_index ];
+	xhd_action_t* bound = xhd_modes_find_action( mode, keysym, modifier, event );
+
+	// Replacing a plain hotkey is fine, silently cutting off the sequences behind it is not
+	if ( bound != NULL && bound->next_name != NULL && xhd_config_enters_node( parser->modelist, bound ) )
+	{
+		fprintf( stderr, "Key combo already starts a key sequence, it cannot also be a hotkey\n" );
+		xhd_config_print_error( &combo );
+		return -1;
+	}
 
-	if ( xhd_config_parse_command_list( parser, &action ) )
+	// Every key producing the keysym shares the action
+	if ( xhd_modes_add_action( parser->modelist, mode, keysym, modifier, event, action ) )
 		return -1;
 
-	if ( xhd_modes_add_action ( &parser->modelist->modes[ parser->modelist->cur_mode ],
-	                       		keysym, &action ) )
+	if ( action->name != NULL && xhd_modes_register_name( &parser->modelist->arena, mode, action ) )
 		return -1;
 
 	if ( xhd_config_expect( parser, '}' ) )
@@ -421,60 +684,42 @@ int xhd_config_parse_hotkey_list ( parser_t* parser )
 	return 0;
 }
 
-int xhd_config_parse_mode_name ( parser_t* parser, char* name_buf )
+int xhd_config_parse_mode_entry ( parser_t* parser )
 {
-	char     c;
-	uint32_t name_index = 0;
+	xhd_token_t name;
 
-	memset( name_buf, 0, MAXNAMELEN + 1 );
+	if ( xhd_config_parse_word( parser, &name ) )
+		return -1;
 
-	while ( 1 )
+	if ( name.len == 0 )
 	{
-		if ( name_index >= MAXNAMELEN - 1 )
-		{
-			xhd_config_print_error( parser );
-			return -1;
-		}
-
-		// Get next character
-		c = xhd_config_read_char( parser );
-
-		if ( xhd_config_is_whitespace( c ) )
-		{
-			// Skip whitespaces
-			continue;
-		}
-		else if ( c == '{' )
-		{
-			// End State
-			parser->buffer_index--;
-			break;
-		}
-
-		name_buf[ name_index++ ] = c;
+		fprintf( stderr, "Expected a mode name\n" );
+		xhd_config_print_error( parser );
+		return -1;
 	}
 
-	return 0;
-}
-
-int xhd_config_parse_mode_entry ( parser_t* parser )
-{
-	char name_buf[ MAXNAMELEN ];
-
-	if ( xhd_config_parse_mode_name( parser, name_buf ) )
+	// Reserved for the modes of key sequence prefixes
+	if ( memchr( name.str, '/', name.len ) != NULL )
+	{
+		fprintf( stderr, "Mode names cannot contain '/'\n" );
+		xhd_config_print_error( parser );
 		return -1;
+	}
 
-	if ( xhd_modes_register_mode( parser->modelist, name_buf ) )
+	if ( xhd_modes_register_mode( parser->modelist, name.str, name.len ) )
 		return -1;
 
+	// Hotkeys go to the mode being parsed
+	parser->modelist->cur_mode = parser->modelist->num_modes - 1;
+
+	xhd_config_trim_whitespace( parser );
+
 	if ( xhd_config_expect( parser, '{' ) )
 		return -1;
 
 	if ( xhd_config_parse_hotkey_list( parser ) )
 		return -1;
 
-	parser->modelist->cur_mode = parser->modelist->num_modes;
-
 	if ( xhd_config_expect( parser, '}' ) )
 		return -1;
 
@@ -496,64 +741,252 @@ int xhd_config_parse_config_file ( parser_t* parser )
 	return 0;
 }
 
+/**
+ * XHD Config Default Path Function
+ *
+ * Writes the default config location:
+ * $XDG_CONFIG_HOME/xhd/config, else $HOME/.config/xhd/config
+ */
+int xhd_config_default_path ( char* config_path, size_t len )
+{
+	char* config_home = getenv( "XDG_CONFIG_HOME" );
+
+	if ( config_home != NULL && config_home[0] != '\0' )
+	{
+		snprintf( config_path, len, "%s/%s", config_home, "xhd/config" );
+		return 0;
+	}
+
+	config_home = getenv( "HOME" );
+
+	if ( config_home == NULL )
+	{
+		fprintf( stderr, "Error; unable to find config file.\n" );
+		return -1;
+	}
+
+	snprintf( config_path, len, "%s/%s", config_home, ".config/xhd/config" );
+	return 0;
+}
+
 /**
  * XHD Config Parse Function
  *
  * This is the start of the config file parser.
- * It opens the file, starts the parser, and closes the file.
+ * It maps the file, starts the parser, and unmaps the file.
+ * On failure the modelist may be partially filled; the caller frees it.
  */
-int xhd_config_parse ( xhd_modelist_t* modelist )
+int xhd_config_parse ( xhd_modelist_t* modelist, const char* config_path )
 {
-	parser_t parser;
-	char config_path [256];
+	parser_t    parser;
+	struct stat st;
+	int         ret  = 0;
+	void*       data = NULL;
 
-	// Open File
-	char* config_home = getenv( "XDG_CONFIG_HOME" );
+	// Map File
+	int fd = open( config_path, O_RDONLY | O_CLOEXEC );
 
-	if ( config_home != NULL )
+	if ( fd < 0 || fstat( fd, &st ) )
 	{
-		snprintf( config_path, sizeof(config_path), "%s/%s", config_home, "xhd/config" );
+		fprintf( stderr, "Error; cannot open config file %s: %s\n", config_path, strerror( errno ) );
+
+		if ( fd >= 0 )
+			close( fd );
+
+		return -1;
 	}
-	else
+
+	if ( st.st_size > 0 )
 	{
-		config_home = getenv( "HOME" );
+		data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
 
-		if ( config_home == NULL )
+		if ( data == MAP_FAILED )
 		{
-			fprintf( stderr, "Error; unable to find config file." );
+			fprintf( stderr, "Error; cannot map config file %s: %s\n", config_path, strerror( errno ) );
+			close( fd );
 			return -1;
 		}
 
-		snprintf( config_path, sizeof(config_path), "%s/%s", config_home, ".config/xhd/config" );
+		madvise( data, st.st_size, MADV_SEQUENTIAL );
+	}
+
+	close( fd );
+
+	parser.data       = (const char*) data;
+	parser.len        = st.st_size;
+	parser.pos        = 0;
+	parser.line       = 1;
+	parser.line_start = 0;
+	parser.modelist   = modelist;
+
+	// Parse File
+	if ( xhd_config_parse_config_file( &parser ) )
+	{
+		fprintf( stderr, "Failed to parse config file.\n" );
+		ret = -1;
+		goto exit;
+	}
+
+	if ( modelist->num_modes == 0 )
+	{
+		fprintf( stderr, "Config file has no modes.\n" );
+		ret = -1;
+		goto exit;
+	}
+
+	parser.modelist->cur_mode = 0;
+
+	// Precompute the runtime tables
+	if ( xhd_modes_finalize( parser.modelist ) )
+	{
+		fprintf( stderr, "Failed to prepare modes.\n" );
+		ret = -1;
+		goto exit;
 	}
 
-	// FILE* config = fopen( config_path, "r" );
-	FILE* config = fopen( "config", "r" );
+	exit:
+		// Unmap File
+		if ( data != NULL )
+			munmap( data, st.st_size );
+
+		return ret;
+}
+
+/**
+ * XHD Config Load Function
+ *
+ * Loads the compiled cache if it still matches the config file
+ * and the keyboard map, otherwise parses the config file.
+ * On failure the modelist may be partially filled; the caller frees it.
+ */
+int xhd_config_load ( xhd_modelist_t* modelist, const char* config_path, const char* cache_path )
+{
+	uint64_t       config_hash;
+	xhd_keysyms_t* keysyms;
 
-	if ( config == NULL )
+	if ( cache_path != NULL && xhd_cache_hash_file( config_path, &config_hash ) == 0 && ( keysyms = xhd_keysyms_acquire() ) != NULL )
 	{
-		fprintf( stderr, "Error; cannot open config file.\n" );
+		uint64_t keymap_hash = xhd_cache_keymap_hash( keysyms );
+		xhd_keysyms_release( keysyms );
+
+		if ( xhd_cache_load( modelist, cache_path, config_hash, keymap_hash ) == 0 )
+			return 0;
+
+		// Start the parse from an empty modelist
+		if ( xhd_modes_fini( modelist ) || xhd_modes_init( modelist ) )
+			return -1;
+	}
+
+	return xhd_config_parse( modelist, config_path );
+}
+
+/**
+ * XHD Config Compile Function
+ *
+ * Parses the config file and writes it out as a cache
+ */
+int xhd_config_compile ( const char* config_path, const char* cache_path )
+{
+	int            ret = -1;
+	uint64_t       config_hash;
+	xhd_keysyms_t* keysyms = NULL;
+	xhd_modelist_t modelist;
+
+	if ( xhd_modes_init( &modelist ) )
 		return -1;
+
+	// Hash what is about to be parsed
+	if ( xhd_cache_hash_file( config_path, &config_hash ) )
+	{
+		fprintf( stderr, "Error; cannot read config file %s: %s\n", config_path, strerror( errno ) );
+		goto exit;
 	}
 
-	parser.config       = config;
-	parser.buffer_index = 0;
-	parser.buffer_len   = 0;
-	parser.lines_read   = 0;
-	parser.modelist     = modelist;
+	if ( xhd_config_parse( &modelist, config_path ) )
+		goto exit;
 
-	// Parse File
-	if ( xhd_config_parse_config_file( &parser ) )
+	keysyms = xhd_keysyms_acquire();
+
+	if ( keysyms == NULL )
+		goto exit;
+
+	ret = xhd_cache_write( &modelist, cache_path, config_hash, xhd_cache_keymap_hash( keysyms ) );
+
+	exit:
+		if ( keysyms != NULL )
+			xhd_keysyms_release( keysyms );
+
+		xhd_modes_fini( &modelist );
+		return ret;
+}
+
+/**
+ * XHD Config Watch Function
+ *
+ * Watches the directory of the config file, since editors often
+ * replace the file rather than write to it
+ * Returns an inotify descriptor, or -1
+ */
+int xhd_config_watch ( const char* config_path )
+{
+	char dir[ PATH_MAX ];
+	const char* slash = strrchr( config_path, '/' );
+
+	if ( slash == NULL )
+		snprintf( dir, sizeof(dir), "." );
+	else if ( slash == config_path )
+		snprintf( dir, sizeof(dir), "/" );
+	else
+		snprintf( dir, sizeof(dir), "%.*s", (int) ( slash - config_path ), config_path );
+
+	int fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+
+	if ( fd < 0 )
 	{
-		fprintf( stderr, "Failed to parse config file.\n" );
+		fprintf( stderr, "Failed to watch config: %s\n", strerror( errno ) );
 		return -1;
 	}
 
-	parser.modelist->cur_mode = 0;
+	if ( inotify_add_watch( fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE ) < 0 )
+	{
+		fprintf( stderr, "Failed to watch %s: %s\n", dir, strerror( errno ) );
+		close( fd );
+		return -1;
+	}
 
-	// Close File
-	fclose( config );
-	return 0;
+	return fd;
+}
+
+/**
+ * XHD Config Changed Function
+ *
+ * Drains an inotify descriptor from xhd_config_watch
+ * Returns 1 if any event concerned the config file
+ */
+int xhd_config_changed ( int fd, const char* config_path )
+{
+	char buf[ 4096 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+	const char* slash = strrchr( config_path, '/' );
+	const char* name  = slash ? slash + 1 : config_path;
+	int changed = 0;
+	ssize_t len;
+
+	while ( ( len = read( fd, buf, sizeof(buf) ) ) > 0 )
+	{
+		char* ptr = buf;
+
+		while ( ptr < buf + len )
+		{
+			struct inotify_event* event = (struct inotify_event*) ptr;
+
+			if ( event->len > 0 && strcmp( event->name, name ) == 0 )
+				changed = 1;
+
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return changed;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,487 @@
+#ifndef XHD_CONTROL_LIB_H
+#define XHD_CONTROL_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xhd_types.h"
+#include "xhd_loop.h"
+
+/**
+ * The Control Socket
+ *
+ * A local SOCK_SEQPACKET socket; every packet is one line of text.
+ * A request is a verb and an optional argument:
+ *
+ *   run NAME      run the action flagged --name NAME
+ *   mode NAME     switch to mode NAME
+ *   reload        reload the config
+ *   stats         the command history and latency histograms
+ *   state         the current mode and group
+ *   subscribe     the current state, then an event for every change
+ *
+ * Each reply is any number of "data TEXT" packets, then one "ok [TEXT]"
+ * or "error TEXT" packet. Subscribers are then sent "event mode NAME" and
+ * "event group N" as they happen.
+ */
+#define XHD_CONTROL_MAXMSG 4096
+
+typedef struct xhd_control_client_t
+{
+	xhd_source_t* source;		// The connection
+	int           subscribed;	// Receives events
+	int           busy;			// A request is being handled
+	int           closing;		// Dropped while busy
+
+	struct xhd_control_client_t* next;
+
+} xhd_control_client_t;
+
+typedef void (*xhd_control_handler_t)( xhd_control_client_t* client, const char* verb, const char* arg, void* data );
+
+int                   xhd_control_fd      = -1;
+xhd_source_t*         xhd_control_source  = NULL;
+xhd_control_client_t* xhd_control_clients = NULL;
+xhd_control_handler_t xhd_control_handler = NULL;
+char                  xhd_control_path[ sizeof( ((struct sockaddr_un*) 0)->sun_path ) ];
+
+/**
+ * XHD Control Default Path Function
+ *
+ * Writes $XDG_RUNTIME_DIR/xhd-DISPLAY.sock, else /tmp/xhd-UID-DISPLAY.sock
+ */
+int xhd_control_default_path ( char* path, size_t len )
+{
+	char        display[ 64 ];
+	const char* runtime_dir = getenv( "XDG_RUNTIME_DIR" );
+	const char* env         = getenv( "DISPLAY" );
+	uint32_t    i;
+	int         ret;
+
+	snprintf( display, sizeof(display), "%s", env ? env : "" );
+
+	for ( i = 0; display[i] != '\0'; ++i )
+	{
+		if ( display[i] == '/' )
+			display[i] = '_';
+	}
+
+	if ( runtime_dir != NULL && runtime_dir[0] != '\0' )
+		ret = snprintf( path, len, "%s/xhd-%s.sock", runtime_dir, display );
+	else
+		ret = snprintf( path, len, "/tmp/xhd-%d-%s.sock", (int) getuid(), display );
+
+	return ret < 0 || (size_t) ret >= len ? -1 : 0;
+}
+
+/**
+ * XHD Control Connect Function
+ *
+ * Connects to the control socket at path
+ * Returns the connection, or -1
+ */
+int xhd_control_connect ( const char* path )
+{
+	struct sockaddr_un addr;
+	int fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+
+	if ( fd < 0 )
+		return -1;
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	snprintf( addr.sun_path, sizeof(addr.sun_path), "%s", path );
+
+	if ( connect( fd, (struct sockaddr*) &addr, sizeof(addr) ) )
+	{
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * XHD Control Send Function
+ *
+ * Sends one packet without blocking
+ */
+static
+int xhd_control_send ( int fd, const char* msg, size_t len )
+{
+	if ( send( fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL ) != (ssize_t) len )
+		return -1;
+
+	return 0;
+}
+
+/**
+ * XHD Control Drop Function
+ *
+ * Disconnects a client, once it is no longer in use
+ */
+void xhd_control_drop ( xhd_control_client_t* client )
+{
+	xhd_control_client_t** it;
+
+	if ( client->busy )
+	{
+		client->closing = 1;
+		return;
+	}
+
+	for ( it = &xhd_control_clients; *it != NULL; it = &(*it)->next )
+	{
+		if ( *it == client )
+		{
+			*it = client->next;
+			break;
+		}
+	}
+
+	xhd_loop_remove( client->source );
+	close( client->source->fd );
+	free( client );
+}
+
+/**
+ * XHD Control Reply Function
+ *
+ * Sends one formatted packet to a client
+ * A client that cannot keep up is dropped
+ */
+int xhd_control_reply ( xhd_control_client_t* client, const char* fmt, ... )
+{
+	char    msg[ XHD_CONTROL_MAXMSG ];
+	va_list args;
+
+	if ( client->closing )
+		return -1;
+
+	va_start( args, fmt );
+	int len = vsnprintf( msg, sizeof(msg), fmt, args );
+	va_end( args );
+
+	if ( len < 0 )
+		return -1;
+
+	if ( (size_t) len >= sizeof(msg) )
+		len = sizeof(msg) - 1;
+
+	if ( xhd_control_send( client->source->fd, msg, len ) )
+	{
+		xhd_control_drop( client );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Control Reply Data Function
+ *
+ * Sends text to a client as data packets, split at line ends
+ */
+int xhd_control_reply_data ( xhd_control_client_t* client, const char* text, size_t len )
+{
+	const size_t max = XHD_CONTROL_MAXMSG - sizeof("data ");
+
+	while ( len != 0 )
+	{
+		size_t chunk = len < max ? len : max;
+
+		// Prefer whole lines
+		if ( chunk < len )
+		{
+			size_t end = chunk;
+
+			while ( end > 0 && text[ end - 1 ] != '\n' )
+				--end;
+
+			if ( end > 0 )
+				chunk = end;
+		}
+
+		if ( xhd_control_reply( client, "data %.*s", (int) chunk, text ) )
+			return -1;
+
+		text += chunk;
+		len  -= chunk;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Control Broadcast Function
+ *
+ * Sends one formatted event to every subscriber
+ */
+void xhd_control_broadcast ( const char* fmt, ... )
+{
+	char    msg[ XHD_CONTROL_MAXMSG ];
+	va_list args;
+
+	xhd_control_client_t* client = xhd_control_clients;
+
+	va_start( args, fmt );
+	int len = vsnprintf( msg, sizeof(msg), fmt, args );
+	va_end( args );
+
+	if ( len < 0 )
+		return;
+
+	if ( (size_t) len >= sizeof(msg) )
+		len = sizeof(msg) - 1;
+
+	while ( client != NULL )
+	{
+		xhd_control_client_t* next = client->next;
+
+		if ( client->subscribed && ! client->closing && xhd_control_send( client->source->fd, msg, len ) )
+			xhd_control_drop( client );
+
+		client = next;
+	}
+}
+
+/**
+ * XHD Control On Client Function
+ *
+ * Handles the requests waiting on a connection
+ */
+void xhd_control_on_client ( xhd_source_t* source, uint32_t events )
+{
+	char msg[ XHD_CONTROL_MAXMSG + 1 ];
+	xhd_control_client_t* client = (xhd_control_client_t*) source->data;
+
+	while ( ! client->closing )
+	{
+		ssize_t len = recv( source->fd, msg, XHD_CONTROL_MAXMSG, MSG_DONTWAIT | MSG_TRUNC );
+
+		if ( len < 0 && ( errno == EAGAIN || errno == EINTR ) )
+			return;
+
+		if ( len <= 0 )
+			break;
+
+		client->busy = 1;
+
+		if ( len > XHD_CONTROL_MAXMSG )
+		{
+			xhd_control_reply( client, "error request too long" );
+		}
+		else
+		{
+			msg[ len ] = '\0';
+
+			while ( len > 0 && ( msg[ len - 1 ] == '\n' || msg[ len - 1 ] == ' ' ) )
+				msg[ --len ] = '\0';
+
+			char* arg = strchr( msg, ' ' );
+
+			if ( arg != NULL )
+				*arg++ = '\0';
+
+			xhd_control_handler( client, msg, arg ? arg : "", xhd_control_source->data );
+		}
+
+		client->busy = 0;
+	}
+
+	client->busy = 0;
+	xhd_control_drop( client );
+}
+
+/**
+ * XHD Control On Listen Function
+ *
+ * Accepts new connections
+ */
+void xhd_control_on_listen ( xhd_source_t* source, uint32_t events )
+{
+	int fd;
+
+	while ( ( fd = accept4( source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 )
+	{
+		xhd_control_client_t* client = (xhd_control_client_t*) calloc( 1, sizeof(xhd_control_client_t) );
+
+		if ( client == NULL )
+		{
+			free( client );
+			close( fd );
+			continue;
+		}
+
+		client->source = xhd_loop_add( fd, EPOLLIN, xhd_control_on_client, client );
+
+		if ( client->source == NULL )
+		{
+			close( fd );
+			free( client );
+			continue;
+		}
+
+		client->next        = xhd_control_clients;
+		xhd_control_clients = client;
+	}
+}
+
+/**
+ * XHD Control Open Function
+ *
+ * Listens on the control socket at path and adds it to the event loop
+ * Requests are passed to handler along with data
+ */
+int xhd_control_open ( const char* path, xhd_control_handler_t handler, void* data )
+{
+	struct sockaddr_un addr;
+
+	// A socket that still answers belongs to a running xhd
+	int fd = xhd_control_connect( path );
+
+	if ( fd >= 0 )
+	{
+		fprintf( stderr, "Control socket %s is in use; is xhd already running?\n", path );
+		close( fd );
+		return -1;
+	}
+
+	unlink( path );
+
+	fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+	if ( fd < 0 )
+		goto fail;
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	snprintf( addr.sun_path, sizeof(addr.sun_path), "%s", path );
+
+	// Only this user may connect
+	mode_t mask = umask( 0077 );
+	int    ret  = bind( fd, (struct sockaddr*) &addr, sizeof(addr) );
+	umask( mask );
+
+	if ( ret || listen( fd, 16 ) )
+		goto fail;
+
+	xhd_control_handler = handler;
+	xhd_control_source  = xhd_loop_add( fd, EPOLLIN, xhd_control_on_listen, data );
+
+	if ( xhd_control_source == NULL )
+	{
+		unlink( path );
+		close( fd );
+		return -1;
+	}
+
+	xhd_control_fd = fd;
+	snprintf( xhd_control_path, sizeof(xhd_control_path), "%s", path );
+	return 0;
+
+	fail:
+		fprintf( stderr, "Failed to open control socket %s: %s\n", path, strerror( errno ) );
+
+		if ( fd >= 0 )
+			close( fd );
+
+		return -1;
+}
+
+/**
+ * XHD Control Close Function
+ *
+ * Disconnects every client and removes the socket
+ */
+void xhd_control_close ( void )
+{
+	while ( xhd_control_clients != NULL )
+		xhd_control_drop( xhd_control_clients );
+
+	if ( xhd_control_fd < 0 )
+		return;
+
+	xhd_loop_remove( xhd_control_source );
+	close( xhd_control_fd );
+	unlink( xhd_control_path );
+
+	xhd_control_fd     = -1;
+	xhd_control_source = NULL;
+}
+
+/**
+ * XHD Control Request Function
+ *
+ * The client side: sends one request and prints the reply to out.
+ * After a subscribe, keeps printing events until the daemon goes away.
+ * Returns 0 if the request succeeded
+ */
+int xhd_control_request ( const char* path, const char* request, FILE* out )
+{
+	char msg[ XHD_CONTROL_MAXMSG + 1 ];
+	int  fd        = xhd_control_connect( path );
+	int  subscribe = strcmp( request, "subscribe" ) == 0;
+	int  ret       = 1;
+
+	if ( fd < 0 )
+	{
+		fprintf( stderr, "Cannot connect to %s: %s\n", path, strerror( errno ) );
+		return 1;
+	}
+
+	if ( send( fd, request, strlen( request ), MSG_NOSIGNAL ) < 0 )
+	{
+		fprintf( stderr, "Cannot send request: %s\n", strerror( errno ) );
+		close( fd );
+		return 1;
+	}
+
+	while ( 1 )
+	{
+		ssize_t len = recv( fd, msg, XHD_CONTROL_MAXMSG, 0 );
+
+		if ( len <= 0 )
+			break;
+
+		msg[ len ] = '\0';
+
+		if ( strncmp( msg, "data ", 5 ) == 0 )
+		{
+			fputs( msg + 5, out );
+		}
+		else if ( strncmp( msg, "ok", 2 ) == 0 )
+		{
+			if ( msg[2] == ' ' )
+				fprintf( out, "%s\n", msg + 3 );
+
+			ret = 0;
+
+			if ( ! subscribe )
+				break;
+		}
+		else if ( strncmp( msg, "event ", 6 ) == 0 )
+		{
+			fprintf( out, "%s\n", msg + 6 );
+		}
+		else
+		{
+			fprintf( stderr, "%s\n", strncmp( msg, "error ", 6 ) == 0 ? msg + 6 : msg );
+			break;
+		}
+
+		fflush( out );
+	}
+
+	close( fd );
+	return ret;
+}
+
+#endif
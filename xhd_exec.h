@@ -0,0 +1,208 @@
+#ifndef XHD_EXEC_LIB_H
+#define XHD_EXEC_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "xhd_types.h"
+#include "xhd_arena.h"
+
+extern char** environ;
+
+// Attributes shared by every spawn, see xhd_exec_init
+posix_spawnattr_t xhd_exec_attr;
+
+// Shell for commands that need one: $XHD_SHELL, else $SHELL, else /bin/sh
+char* xhd_exec_shell = NULL;
+
+// Anything the shell would interpret; commands without these are exec'd directly
+#define XHD_EXEC_SHELL_CHARS "|&;<>()$`\\\"'*?[]#~=%!{}\n"
+
+/**
+ * XHD Exec Cloexec Function
+ *
+ * Marks a daemon file descriptor so no command ever inherits it
+ */
+int xhd_exec_cloexec ( int fd )
+{
+	int flags = fcntl( fd, F_GETFD );
+
+	if ( flags == -1 || fcntl( fd, F_SETFD, flags | FD_CLOEXEC ) == -1 )
+	{
+		fprintf( stderr, "Failed to set close-on-exec: %s\n", strerror( errno ) );
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Exec Init Function
+ *
+ * Picks the shell and prepares the spawn attributes:
+ * commands start with an empty signal mask and default signal handlers,
+ * whatever the daemon itself blocks or handles
+ */
+int xhd_exec_init ( void )
+{
+	sigset_t none;
+	sigset_t all;
+	short    flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+#ifdef POSIX_SPAWN_USEVFORK
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
+
+	const char* shell = getenv( "XHD_SHELL" );
+
+	if ( shell == NULL || shell[0] == '\0' )
+		shell = getenv( "SHELL" );
+
+	if ( shell == NULL || shell[0] == '\0' )
+		shell = "/bin/sh";
+
+	xhd_exec_shell = strdup( shell );
+
+	if ( xhd_exec_shell == NULL )
+	{
+		fprintf( stderr, "Failed to prepare spawn attributes: no memory\n" );
+		return -ENOMEM;
+	}
+
+	sigemptyset( &none );
+	sigfillset( &all );
+
+	if ( posix_spawnattr_init( &xhd_exec_attr )
+	     || posix_spawnattr_setflags( &xhd_exec_attr, flags )
+	     || posix_spawnattr_setsigmask( &xhd_exec_attr, &none )
+	     || posix_spawnattr_setsigdefault( &xhd_exec_attr, &all ) )
+	{
+		fprintf( stderr, "Failed to prepare spawn attributes.\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Exec Fini Function
+ *
+ * Cleans up the spawn attributes
+ */
+void xhd_exec_fini ( void )
+{
+	posix_spawnattr_destroy( &xhd_exec_attr );
+	free( xhd_exec_shell );
+	xhd_exec_shell = NULL;
+}
+
+/**
+ * XHD Exec Prepare Function
+ *
+ * Builds a command from len characters of a config line,
+ * including its argument vector.
+ * Lines without shell syntax are split on whitespace and exec'd directly,
+ * everything else is handed to the shell.
+ * The line, the vector and the words it points to live in the arena.
+ */
+int xhd_exec_prepare ( xhd_arena_t* arena, xhd_command_t* cmd, const char* str, size_t line_len )
+{
+	uint32_t i;
+	uint32_t num_words = 0;
+	int      in_word   = 0;
+
+	cmd->line = xhd_arena_strndup( arena, str, line_len );
+	cmd->argv = NULL;
+
+	if ( cmd->line == NULL )
+		goto fail;
+
+	const char* line = cmd->line;
+
+	// Count words, only if nothing needs the shell
+	if ( strpbrk( line, XHD_EXEC_SHELL_CHARS ) == NULL )
+	{
+		for ( i = 0; i < line_len; ++i )
+		{
+			int is_space = line[i] == ' ' || line[i] == '\t' || line[i] == '\r';
+
+			if ( ! is_space && ! in_word )
+				num_words++;
+
+			in_word = ! is_space;
+		}
+	}
+
+	if ( num_words == 0 )
+	{
+		cmd->argv = (char**) xhd_arena_alloc( arena, sizeof(char*) * 4 );
+
+		if ( cmd->argv == NULL )
+			goto fail;
+
+		cmd->argv[0] = xhd_exec_shell;
+		cmd->argv[1] = (char*) "-c";
+		cmd->argv[2] = cmd->line;
+		cmd->argv[3] = NULL;
+		return 0;
+	}
+
+	cmd->argv = (char**) xhd_arena_alloc( arena, sizeof(char*) * ( num_words + 1 ) + line_len + 1 );
+
+	if ( cmd->argv == NULL )
+		goto fail;
+
+	char* words = (char*) ( cmd->argv + num_words + 1 );
+	memcpy( words, line, line_len + 1 );
+
+	num_words = 0;
+	in_word   = 0;
+
+	for ( i = 0; i < line_len; ++i )
+	{
+		int is_space = words[i] == ' ' || words[i] == '\t' || words[i] == '\r';
+
+		if ( is_space )
+			words[i] = '\0';
+		else if ( ! in_word )
+			cmd->argv[ num_words++ ] = &words[i];
+
+		in_word = ! is_space;
+	}
+
+	cmd->argv[ num_words ] = NULL;
+	return 0;
+
+	fail:
+		fprintf( stderr, "Failed to prepare command: no memory\n" );
+		cmd->line = NULL;
+		return -ENOMEM;
+}
+
+/**
+ * XHD Exec Spawn Function
+ *
+ * Starts a command without copying the daemon's address space
+ * Returns the child pid, or -1 if it could not be started
+ */
+pid_t xhd_exec_spawn ( const xhd_command_t* cmd )
+{
+	pid_t pid;
+	int   err = posix_spawnp( &pid, cmd->argv[0], NULL, &xhd_exec_attr, cmd->argv, environ );
+
+	if ( err != 0 )
+	{
+		fprintf( stderr, "Failed to run %s: %s\n", cmd->line, strerror( err ) );
+		return -1;
+	}
+
+	return pid;
+}
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef XHD_EXECUTOR_LIB_H
+#define XHD_EXECUTOR_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "xhd_types.h"
+#include "xhd_exec.h"
+#include "xhd_procs.h"
+
+/**
+ * The Executor
+ *
+ * An optional helper process forked at startup, before the X connection
+ * and keymaps exist, so its address space stays tiny.
+ * The daemon sends it one datagram per command over a socketpair:
+ * an xhd_executor_msg_t followed by argc NUL terminated arguments.
+ * Sends never block; if the helper cannot take a command,
+ * the daemon spawns it itself.
+ * The helper reaps its children and sends back one xhd_procrecord_t each,
+ * a command it cannot track is not run and reported as failed.
+ * If the helper dies, its running commands are reported as failed.
+ */
+typedef struct xhd_executor_msg_t
+{
+	uint32_t tag;		// The spawn tag, echoed back in the record
+	uint32_t argc;		// The number of arguments that follow
+
+} xhd_executor_msg_t;
+
+// The daemon's end of the socketpair, -1 when there is no executor
+int xhd_executor_fd = -1;
+
+// The helper's end of the socketpair, only valid in the helper
+static int xhd_executor_helper_fd = -1;
+
+static
+void xhd_executor_report ( xhd_procrecord_t* record, const xhd_child_t* child, void* data )
+{
+	if ( record->tag != 0 )
+		send( xhd_executor_helper_fd, record, sizeof(*record), MSG_NOSIGNAL );
+}
+
+/**
+ * XHD Executor Run Function
+ *
+ * The helper's main loop: receive commands and spawn them until the daemon goes away
+ */
+static
+void xhd_executor_run ( int fd )
+{
+	size_t alloc_buf = 4096;
+	char*  buf       = (char*) malloc( alloc_buf );
+	char** argv      = NULL;
+	size_t alloc_arg = 0;
+
+	sigset_t mask;
+	struct pollfd fds[2];
+
+	prctl( PR_SET_NAME, "xhd-executor", 0, 0, 0 );
+
+	xhd_executor_helper_fd = fd;
+
+	sigemptyset( &mask );
+	fds[0].fd     = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd     = xhd_procs_signalfd( &mask );
+	fds[1].events = POLLIN;
+
+	while ( buf != NULL && fds[1].fd >= 0 )
+	{
+		if ( poll( fds, 2, -1 ) < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+
+		if ( fds[1].revents & POLLIN )
+		{
+			xhd_procs_drain( fds[1].fd );
+			xhd_procs_reap( xhd_executor_report, NULL );
+		}
+
+		if ( ! ( fds[0].revents & ( POLLIN | POLLHUP ) ) )
+			continue;
+
+		// Learn the datagram size first so no command is truncated
+		ssize_t len = recv( fd, buf, alloc_buf, MSG_PEEK | MSG_TRUNC );
+
+		if ( len <= 0 )
+		{
+			if ( len < 0 && errno == EINTR )
+				continue;
+			break;
+		}
+
+		if ( (size_t) len > alloc_buf )
+		{
+			char* tmp = (char*) realloc( buf, len );
+
+			if ( tmp == NULL )
+				break;
+
+			buf       = tmp;
+			alloc_buf = len;
+		}
+
+		len = recv( fd, buf, alloc_buf, 0 );
+
+		if ( len < (ssize_t) sizeof(xhd_executor_msg_t) )
+			continue;
+
+		xhd_executor_msg_t* msg = (xhd_executor_msg_t*) buf;
+
+		if ( alloc_arg < msg->argc + 1 )
+		{
+			char** tmp = (char**) realloc( argv, sizeof(char*) * ( msg->argc + 1 ) );
+
+			if ( tmp == NULL )
+				break;
+
+			argv      = tmp;
+			alloc_arg = msg->argc + 1;
+		}
+
+		// Point the vector into the datagram
+		char*    arg = buf + sizeof(xhd_executor_msg_t);
+		char*    end = buf + len;
+		uint32_t i;
+
+		for ( i = 0; i < msg->argc && arg < end; ++i )
+		{
+			argv[i] = arg;
+			arg    += strnlen( arg, end - arg ) + 1;
+		}
+
+		if ( i == 0 || arg > end )
+			continue;
+
+		argv[i] = NULL;
+
+		// Its record could never be matched, so the daemon would wait for it forever
+		if ( xhd_procs_full() )
+		{
+			xhd_procrecord_t record;
+
+			fprintf( stderr, "Executor has too many running commands, not running %s\n", argv[0] );
+			memset( &record, 0, sizeof(record) );
+			record.tag    = msg->tag;
+			record.status = 127 << 8;
+			xhd_executor_report( &record, NULL, NULL );
+			continue;
+		}
+
+		pid_t    pid;
+		uint64_t start = xhd_procs_now_ns();
+		int      err   = posix_spawnp( &pid, argv[0], NULL, &xhd_exec_attr, argv, environ );
+
+		if ( err != 0 )
+		{
+			// Report it as if the command could not be found
+			xhd_procrecord_t record;
+
+			fprintf( stderr, "Failed to run %s: %s\n", argv[0], strerror( err ) );
+			memset( &record, 0, sizeof(record) );
+			record.tag    = msg->tag;
+			record.status = 127 << 8;
+			xhd_executor_report( &record, NULL, NULL );
+			continue;
+		}
+
+		xhd_procs_track( pid, msg->tag, NULL, start, NULL, 0 );
+	}
+
+	free( argv );
+	free( buf );
+}
+
+/**
+ * XHD Executor Start Function
+ *
+ * Forks the executor; must run before the X connection is made
+ */
+int xhd_executor_start ( void )
+{
+	int sv[2];
+
+	if ( socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv ) )
+	{
+		fprintf( stderr, "Failed to create executor socket: %s\n", strerror( errno ) );
+		return -1;
+	}
+
+	pid_t pid = fork();
+
+	if ( pid < 0 )
+	{
+		fprintf( stderr, "Failed to fork executor: %s\n", strerror( errno ) );
+		close( sv[0] );
+		close( sv[1] );
+		return -1;
+	}
+
+	if ( pid == 0 )
+	{
+		close( sv[0] );
+		xhd_executor_run( sv[1] );
+		_exit( 0 );
+	}
+
+	close( sv[1] );
+	xhd_executor_fd = sv[0];
+	return 0;
+}
+
+/**
+ * XHD Executor Send Function
+ *
+ * Hands a command to the executor without blocking
+ * Returns 0 if the executor took it
+ */
+int xhd_executor_send ( const xhd_command_t* cmd, uint32_t tag )
+{
+	uint32_t i;
+	size_t   len = sizeof(xhd_executor_msg_t);
+	char     stack_buf[ 1024 ];
+	char*    buf = stack_buf;
+
+	if ( xhd_executor_fd < 0 )
+		return -1;
+
+	for ( i = 0; cmd->argv[i] != NULL; ++i )
+		len += strlen( cmd->argv[i] ) + 1;
+
+	if ( len > sizeof(stack_buf) )
+	{
+		buf = (char*) malloc( len );
+
+		if ( buf == NULL )
+			return -ENOMEM;
+	}
+
+	xhd_executor_msg_t* msg = (xhd_executor_msg_t*) buf;
+	char*               arg = buf + sizeof(xhd_executor_msg_t);
+
+	msg->tag  = tag;
+	msg->argc = i;
+
+	for ( i = 0; cmd->argv[i] != NULL; ++i )
+	{
+		size_t arg_len = strlen( cmd->argv[i] ) + 1;
+		memcpy( arg, cmd->argv[i], arg_len );
+		arg += arg_len;
+	}
+
+	ssize_t sent = send( xhd_executor_fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL );
+
+	if ( buf != stack_buf )
+		free( buf );
+
+	if ( sent == (ssize_t) len )
+		return 0;
+
+	// A full queue is transient, anything else means the executor is gone;
+	// it is dropped once its end of the socket is read, see xhd_executor_receive
+	if ( errno != EAGAIN && errno != EWOULDBLOCK )
+		fprintf( stderr, "Executor lost: %s\n", strerror( errno ) );
+
+	return -1;
+}
+
+/**
+ * XHD Executor Fail All Function
+ *
+ * Reports every command still running in a lost executor as failed,
+ * so their actions stop waiting for them
+ */
+static
+void xhd_executor_fail_all ( void (*done)( xhd_procrecord_t* record, const xhd_child_t* child, void* data ), void* data )
+{
+	uint32_t         i;
+	uint64_t         now = xhd_procs_now_ns();
+	xhd_procrecord_t record;
+	xhd_child_t      child;
+
+	for ( i = 0; i < XHD_MAX_CHILDREN; ++i )
+	{
+		// Children of the executor have no local pid
+		if ( xhd_procs_children[i].tag == 0 || xhd_procs_children[i].pid != 0 )
+			continue;
+
+		if ( xhd_procs_take( 0, xhd_procs_children[i].tag, &child ) )
+			continue;
+
+		memset( &record, 0, sizeof(record) );
+		record.tag     = child.tag;
+		record.status  = 127 << 8;
+		record.wall_ns = now - child.start_ns;
+		memcpy( record.line, child.line, sizeof(record.line) );
+		memcpy( record.name, child.name, sizeof(record.name) );
+
+		done( &record, &child, data );
+	}
+}
+
+/**
+ * XHD Executor Receive Function
+ *
+ * Collects the records of commands the executor has reaped
+ * and passes them to done like xhd_procs_reap
+ */
+int xhd_executor_receive ( void (*done)( xhd_procrecord_t* record, const xhd_child_t* child, void* data ), void* data )
+{
+	xhd_procrecord_t record;
+	xhd_child_t      child;
+
+	while ( xhd_executor_fd >= 0 )
+	{
+		ssize_t len = recv( xhd_executor_fd, &record, sizeof(record), MSG_DONTWAIT );
+
+		if ( len == sizeof(record) )
+		{
+			// Executor records carry no command text or action, the daemon kept them
+			int tracked = xhd_procs_take( 0, record.tag, &child ) == 0;
+
+			if ( tracked )
+			{
+				memcpy( record.line, child.line, sizeof(record.line) );
+				memcpy( record.name, child.name, sizeof(record.name) );
+			}
+
+			done( &record, tracked ? &child : NULL, data );
+			continue;
+		}
+
+		if ( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+			break;
+
+		if ( len < 0 || len == 0 )
+		{
+			fprintf( stderr, "Executor lost.\n" );
+			close( xhd_executor_fd );
+			xhd_executor_fd = -1;
+			xhd_executor_fail_all( done, data );
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Executor Stop Function
+ *
+ * Closing the socket makes the executor exit
+ */
+void xhd_executor_stop ( void )
+{
+	if ( xhd_executor_fd >= 0 )
+		close( xhd_executor_fd );
+
+	xhd_executor_fd = -1;
+}
+
+#endif
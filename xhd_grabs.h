@@ -0,0 +1,143 @@
+#ifndef XHD_GRABS_LIB_H
+#define XHD_GRABS_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "xhd_types.h"
+
+// Statistics of the last grab batch
+xhd_grabstats_t xhd_grabs_stats = { 0, 0, 0, 0 };
+
+// Cookie buffer, reused across batches
+xcb_void_cookie_t* xhd_grabs_cookies       = NULL;
+uint32_t           xhd_grabs_alloc_cookies = 0;
+
+static const char* xhd_grabs_modifier_names[] =
+{
+	"shift", "lock", "ctrl", "mod1", "mod2", "mod3", "mod4", "mod5"
+};
+
+static inline
+uint64_t xhd_grabs_now_ns ( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * XHD Grabs Describe Function
+ *
+ * Writes the keycombo a grab stands for in a mode and group, e.g. "mod4+Return"
+ */
+void xhd_grabs_describe ( const xhd_mode_t* mode, xhd_group_t group, const xhd_grab_t* grab, char* buf, size_t len )
+{
+	uint32_t i;
+	size_t   used = 0;
+	char     name[64];
+
+	for ( i = 0; i < 8 && used < len; ++i )
+	{
+		if ( grab->modifier & ( 1 << i ) )
+			used += snprintf( buf + used, len - used, "%s+", xhd_grabs_modifier_names[i] );
+	}
+
+	if ( used >= len )
+		return;
+
+	xkb_keysym_t keysym = mode->keysyms->symbols[ XHD_KEY_INDEX( group, grab->keycode, grab->modifier & 1 ) ];
+
+	if ( keysym == 0 || xkb_keysym_get_name( keysym, name, sizeof(name) ) < 0 )
+		snprintf( buf + used, len - used, "keycode %d", grab->keycode );
+	else
+		snprintf( buf + used, len - used, "%s", name );
+}
+
+/**
+ * XHD Grabs Apply Function
+ *
+ * Sends a batch of ungrabs then checked grabs, flushes once,
+ * and collects every grab result in a single round trip.
+ * Grabs refused by the X server are reported per binding.
+ *
+ * Either list may be NULL. Returns the number of failed grabs.
+ */
+int xhd_grabs_apply ( const xhd_mode_t* mode, xhd_group_t group, const xhd_grablist_t* ungrabs, const xhd_grablist_t* grabs )
+{
+	uint32_t i;
+	uint32_t num_ungrabs = ungrabs ? ungrabs->num_grabs : 0;
+	uint32_t num_grabs   = grabs   ? grabs->num_grabs   : 0;
+	uint64_t start       = xhd_grabs_now_ns();
+	char     desc[128];
+
+	xhd_grabs_stats.num_grabs   = num_grabs;
+	xhd_grabs_stats.num_ungrabs = num_ungrabs;
+	xhd_grabs_stats.num_failed  = 0;
+
+	if ( xhd_grabs_alloc_cookies < num_grabs )
+	{
+		xcb_void_cookie_t* tmp = (xcb_void_cookie_t*) realloc( xhd_grabs_cookies, sizeof(xcb_void_cookie_t) * num_grabs );
+
+		if ( tmp == NULL )
+		{
+			fprintf( stderr, "Failed to grab keys: no memory\n" );
+			return -ENOMEM;
+		}
+
+		xhd_grabs_cookies       = tmp;
+		xhd_grabs_alloc_cookies = num_grabs;
+	}
+
+	// Pipeline every request
+	for ( i = 0; i < num_ungrabs; ++i )
+	{
+		xcb_ungrab_key( conn, ungrabs->list[i].keycode, root, ungrabs->list[i].modifier );
+	}
+
+	for ( i = 0; i < num_grabs; ++i )
+	{
+		xhd_grabs_cookies[i] = xcb_grab_key_checked( conn, 0, root, grabs->list[i].modifier, grabs->list[i].keycode,
+		                                             XCB_GRAB_MODE_SYNC, XCB_GRAB_MODE_ASYNC );
+	}
+
+	xcb_flush( conn );
+
+	// The first check syncs past every request, the rest are answered locally
+	for ( i = 0; i < num_grabs; ++i )
+	{
+		xcb_generic_error_t* error = xcb_request_check( conn, xhd_grabs_cookies[i] );
+
+		if ( error == NULL )
+			continue;
+
+		xhd_grabs_stats.num_failed++;
+		xhd_grabs_describe( mode, group, &grabs->list[i], desc, sizeof(desc) );
+
+		if ( error->error_code == XCB_ACCESS )
+			fprintf( stderr, "Failed to grab %s in mode %s: already grabbed by another client\n", desc, mode->name );
+		else
+			fprintf( stderr, "Failed to grab %s in mode %s: X error %d\n", desc, mode->name, error->error_code );
+
+		free( error );
+	}
+
+	xhd_grabs_stats.elapsed_ns = xhd_grabs_now_ns() - start;
+	return xhd_grabs_stats.num_failed;
+}
+
+/**
+ * XHD Grabs Free Function
+ *
+ * Cleans up the grab engine
+ */
+void xhd_grabs_free ( void )
+{
+	free( xhd_grabs_cookies );
+	xhd_grabs_cookies       = NULL;
+	xhd_grabs_alloc_cookies = 0;
+}
+
+#endif
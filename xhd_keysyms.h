@@ -0,0 +1,223 @@
+#ifndef XHD_KEYSYMS_LIB_H
+#define XHD_KEYSYMS_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "xhd_types.h"
+
+// The table for the current keyboard map, NULL until first needed
+xhd_keysyms_t* xhd_keysyms_current    = NULL;
+uint32_t       xhd_keysyms_generation = 0;
+
+static
+int xhd_keysyms_compare_entry ( const void* a, const void* b )
+{
+	const xhd_symentry_t* x = (const xhd_symentry_t*) a;
+	const xhd_symentry_t* y = (const xhd_symentry_t*) b;
+
+	if ( x->symbol != y->symbol )
+		return x->symbol < y->symbol ? -1 : 1;
+
+	if ( x->key_index != y->key_index )
+		return x->key_index < y->key_index ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * XHD Keysyms Index Init Function
+ *
+ * Builds the sorted keysym to keymap position index of a table
+ */
+int xhd_keysyms_index_init ( xhd_keysyms_t* keysyms )
+{
+	uint32_t i;
+	uint32_t num_entries = 0;
+	xhd_symindex_t* index = &keysyms->index;
+
+	for ( i = 0; i < XHD_NUM_KEYS; ++i )
+	{
+		if ( keysyms->symbols[i] != 0 )
+			num_entries++;
+	}
+
+	index->num_entries = 0;
+	index->entries     = (xhd_symentry_t*) malloc( sizeof(xhd_symentry_t) * ( num_entries + 1 ) );
+
+	if ( index->entries == NULL )
+	{
+		fprintf( stderr, "Failed to build symbol index: no memory\n" );
+		return -ENOMEM;
+	}
+
+	for ( i = 0; i < XHD_NUM_KEYS; ++i )
+	{
+		if ( keysyms->symbols[i] != 0 )
+		{
+			index->entries[ index->num_entries ].symbol    = keysyms->symbols[i];
+			index->entries[ index->num_entries ].key_index = i;
+			index->num_entries++;
+		}
+	}
+
+	qsort( index->entries, index->num_entries, sizeof(xhd_symentry_t), xhd_keysyms_compare_entry );
+	return 0;
+}
+
+/**
+ * XHD Keysyms Find Function
+ *
+ * Returns the first index entry for keysym, or the end of the index
+ * Matching entries follow it contiguously
+ */
+static inline
+const xhd_symentry_t* xhd_keysyms_find ( const xhd_symindex_t* index, xkb_keysym_t keysym )
+{
+	uint32_t low  = 0;
+	uint32_t high = index->num_entries;
+
+	while ( low < high )
+	{
+		uint32_t mid = low + ( high - low ) / 2;
+
+		if ( index->entries[ mid ].symbol < keysym )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return &index->entries[ low ];
+}
+
+/**
+ * XHD Keysyms Build Function
+ *
+ * Retrieves and parses the X keymap into a new table
+ */
+xhd_keysyms_t* xhd_keysyms_build ( void )
+{
+	uint32_t key_index;
+	uint32_t level_index;
+	uint32_t group_index;
+	uint32_t max_groups;
+	uint32_t max_levels;
+
+	const xkb_keysym_t* keysym;
+
+	xhd_keysyms_t* keysyms = NULL;
+
+	// Get Core Keyboard
+	int32_t device_id = xkb_x11_get_core_keyboard_device_id( conn );
+
+	if ( device_id == -1 )
+	{
+		fprintf( stderr, "Can't find core keyboard.\n" );
+		goto fail1;
+	}
+
+	// Get XKB Keymap
+	struct xkb_keymap* keymap = xkb_x11_keymap_new_from_device( ctx, conn, device_id, XKB_KEYMAP_COMPILE_NO_FLAGS );
+
+	if ( ! keymap )
+	{
+		fprintf( stderr, "Can't fetch keyboard map.\n" );
+		goto fail1;
+	}
+
+	keysyms = (xhd_keysyms_t*) calloc( 1, sizeof(xhd_keysyms_t) );
+
+	if ( keysyms == NULL )
+	{
+		fprintf( stderr, "Failed to build keysym table: no memory\n" );
+		goto fail2;
+	}
+
+	for ( key_index = 0; key_index < MAX_KEYCODE; ++key_index )
+	{
+		max_groups = xkb_keymap_num_layouts_for_key( keymap, key_index );
+		if ( max_groups >= MAX_GROUPS ) max_groups = MAX_GROUPS;
+		for ( group_index = 0; group_index < max_groups; ++group_index )
+		{
+			max_levels = xkb_keymap_num_levels_for_key( keymap, key_index, group_index );
+			if ( max_levels >= MAX_LEVELS ) max_levels = MAX_LEVELS;
+			for ( level_index = 0; level_index < max_levels; ++level_index )
+			{
+				if ( xkb_keymap_key_get_syms_by_level( keymap, key_index, group_index, level_index, &keysym ) > 0 )
+				{
+					keysyms->symbols[ XHD_KEY_INDEX( group_index, key_index, level_index ) ] = *keysym;
+				}
+			}
+		}
+	}
+
+	if ( xhd_keysyms_index_init( keysyms ) )
+		goto fail3;
+
+	keysyms->refs       = 1;
+	keysyms->generation = xhd_keysyms_generation;
+
+	xkb_keymap_unref( keymap );
+	return keysyms;
+
+	fail3:
+		free( keysyms );
+	fail2:
+		xkb_keymap_unref( keymap );
+	fail1:
+		return NULL;
+}
+
+/**
+ * XHD Keysyms Release Function
+ *
+ * Drops a reference, freeing the table with the last one
+ */
+void xhd_keysyms_release ( xhd_keysyms_t* keysyms )
+{
+	if ( --keysyms->refs != 0 )
+		return;
+
+	free( keysyms->index.entries );
+	free( keysyms );
+}
+
+/**
+ * XHD Keysyms Acquire Function
+ *
+ * Returns a new reference to the table of the current keyboard map
+ * The X keymap is only fetched once per keyboard map generation
+ */
+xhd_keysyms_t* xhd_keysyms_acquire ( void )
+{
+	if ( xhd_keysyms_current == NULL )
+	{
+		xhd_keysyms_current = xhd_keysyms_build();
+
+		if ( xhd_keysyms_current == NULL )
+			return NULL;
+	}
+
+	xhd_keysyms_current->refs++;
+	return xhd_keysyms_current;
+}
+
+/**
+ * XHD Keysyms Invalidate Function
+ *
+ * Called when the keyboard map changes
+ * Existing holders keep their table, the next acquire builds a new one
+ */
+void xhd_keysyms_invalidate ( void )
+{
+	xhd_keysyms_generation++;
+
+	if ( xhd_keysyms_current != NULL )
+	{
+		xhd_keysyms_release( xhd_keysyms_current );
+		xhd_keysyms_current = NULL;
+	}
+}
+
+#endif
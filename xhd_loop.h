@@ -0,0 +1,229 @@
+#ifndef XHD_LOOP_LIB_H
+#define XHD_LOOP_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define XHD_LOOP_EVENTS 32	// Events handled per wakeup
+
+/**
+ * An XHD Loop Source
+ *
+ * A file descriptor watched by the event loop and the callback it wakes.
+ * Sources removed while events are being dispatched are freed afterwards.
+ */
+typedef struct xhd_source_t
+{
+	int    fd;									// The watched descriptor
+	void   (*fn)( struct xhd_source_t*, uint32_t );	// Called with the epoll events
+	void*  data;								// Passed through to fn
+	int    dead;								// Removed, waiting to be freed
+
+	struct xhd_source_t* next_dead;				// The removed source list
+
+} xhd_source_t;
+
+int           xhd_loop_fd   = -1;
+int           xhd_loop_quit = 0;
+xhd_source_t* xhd_loop_dead = NULL;
+
+/**
+ * XHD Loop Init Function
+ *
+ * Creates the epoll instance
+ */
+int xhd_loop_init ( void )
+{
+	xhd_loop_fd = epoll_create1( EPOLL_CLOEXEC );
+
+	if ( xhd_loop_fd < 0 )
+	{
+		fprintf( stderr, "Failed to create event loop: %s\n", strerror( errno ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Loop Add Function
+ *
+ * Watches fd for events, calling fn when any occur
+ * Returns the new source, or NULL
+ */
+xhd_source_t* xhd_loop_add ( int fd, uint32_t events, void (*fn)( xhd_source_t*, uint32_t ), void* data )
+{
+	struct epoll_event ev;
+	xhd_source_t* source = (xhd_source_t*) calloc( 1, sizeof(xhd_source_t) );
+
+	if ( source == NULL )
+	{
+		fprintf( stderr, "Failed to add event source: no memory\n" );
+		return NULL;
+	}
+
+	source->fd   = fd;
+	source->fn   = fn;
+	source->data = data;
+
+	ev.events   = events;
+	ev.data.ptr = source;
+
+	if ( epoll_ctl( xhd_loop_fd, EPOLL_CTL_ADD, fd, &ev ) )
+	{
+		fprintf( stderr, "Failed to add event source: %s\n", strerror( errno ) );
+		free( source );
+		return NULL;
+	}
+
+	return source;
+}
+
+/**
+ * XHD Loop Remove Function
+ *
+ * Stops watching a source; the descriptor itself is left open
+ */
+void xhd_loop_remove ( xhd_source_t* source )
+{
+	if ( source == NULL || source->dead )
+		return;
+
+	// Fails harmlessly if the descriptor was already closed
+	epoll_ctl( xhd_loop_fd, EPOLL_CTL_DEL, source->fd, NULL );
+
+	source->dead      = 1;
+	source->next_dead = xhd_loop_dead;
+	xhd_loop_dead     = source;
+}
+
+/**
+ * XHD Loop Add Timer Function
+ *
+ * Creates a disarmed timerfd source; fn runs each time it expires
+ */
+xhd_source_t* xhd_loop_add_timer ( void (*fn)( xhd_source_t*, uint32_t ), void* data )
+{
+	int fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+
+	if ( fd < 0 )
+	{
+		fprintf( stderr, "Failed to create timer: %s\n", strerror( errno ) );
+		return NULL;
+	}
+
+	xhd_source_t* source = xhd_loop_add( fd, EPOLLIN, fn, data );
+
+	if ( source == NULL )
+		close( fd );
+
+	return source;
+}
+
+/**
+ * XHD Loop Arm Timer Function
+ *
+ * Makes a timer expire once after ms milliseconds, or disarms it for 0
+ */
+int xhd_loop_arm_timer ( xhd_source_t* timer, uint32_t ms )
+{
+	struct itimerspec spec;
+
+	memset( &spec, 0, sizeof(spec) );
+	spec.it_value.tv_sec  = ms / 1000;
+	spec.it_value.tv_nsec = ( ms % 1000 ) * 1000000l;
+
+	return timerfd_settime( timer->fd, 0, &spec, NULL );
+}
+
+/**
+ * XHD Loop Ack Timer Function
+ *
+ * Consumes a timer's expirations, returning how many occurred
+ */
+uint64_t xhd_loop_ack_timer ( xhd_source_t* timer )
+{
+	uint64_t expirations = 0;
+
+	if ( read( timer->fd, &expirations, sizeof(expirations) ) != sizeof(expirations) )
+		return 0;
+
+	return expirations;
+}
+
+/**
+ * XHD Loop Run Function
+ *
+ * Dispatches events until xhd_loop_quit is set
+ * prepare runs before every wait, for work that arrived without waking a descriptor
+ */
+int xhd_loop_run ( void (*prepare)( void* ), void* data )
+{
+	struct epoll_event events[ XHD_LOOP_EVENTS ];
+	int i;
+
+	while ( ! xhd_loop_quit )
+	{
+		if ( prepare != NULL )
+			prepare( data );
+
+		if ( xhd_loop_quit )
+			break;
+
+		int num_events = epoll_wait( xhd_loop_fd, events, XHD_LOOP_EVENTS, -1 );
+
+		if ( num_events < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			fprintf( stderr, "Failed to wait for events: %s\n", strerror( errno ) );
+			return -1;
+		}
+
+		for ( i = 0; i < num_events; ++i )
+		{
+			xhd_source_t* source = (xhd_source_t*) events[i].data.ptr;
+
+			if ( ! source->dead )
+				source->fn( source, events[i].events );
+		}
+
+		// Free the sources removed during dispatch
+		while ( xhd_loop_dead != NULL )
+		{
+			xhd_source_t* source = xhd_loop_dead;
+			xhd_loop_dead = source->next_dead;
+			free( source );
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Loop Fini Function
+ *
+ * Closes the epoll instance; sources must already be removed
+ */
+void xhd_loop_fini ( void )
+{
+	while ( xhd_loop_dead != NULL )
+	{
+		xhd_source_t* source = xhd_loop_dead;
+		xhd_loop_dead = source->next_dead;
+		free( source );
+	}
+
+	if ( xhd_loop_fd >= 0 )
+		close( xhd_loop_fd );
+
+	xhd_loop_fd = -1;
+}
+
+#endif
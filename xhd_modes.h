@@ -3,533 +3,921 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <stdlib.h>
 
 #include "xhd_types.h"
+#include "xhd_arena.h"
+#include "xhd_keysyms.h"
+#include "xhd_exec.h"
+#include "xhd_plugins.h"
+
+// The builtins "@name" commands may use, see xhd_modes_resolve_builtin
+const xhd_builtin_t* xhd_modes_builtins = NULL;
 
 /**
  * XHD Modes Allocate Mode Function
  *
- * Allocates memory for a mode
+ * Allocates memory for a mode from the arena
  */
-int xhd_modes_alloc_mode ( xhd_mode_t* mode )
+int xhd_modes_alloc_mode ( xhd_arena_t* arena, xhd_mode_t* mode )
 {
-	int ret = 0;
-	uint32_t i, j;
-	uint32_t allocated_keysets = 0;
-	uint32_t allocated_levelsets = 0;
-	uint32_t allocated_grablists = 0;
+	uint32_t i;
 
 	// Fallback values
-	mode->name      = NULL;
-	mode->grabs     = NULL;
-	mode->keymap    = NULL;
-	mode->cur_group = 0;
+	mode->name         = NULL;
+	mode->root         = XHD_NO_MODE;
+	mode->grabs        = NULL;
+	mode->deltas       = NULL;
+	mode->switches     = NULL;
+	mode->num_switches = 0;
+	mode->num_named    = 0;
+	mode->alloc_named  = 0;
+	mode->named        = NULL;
+	mode->keymap.keys  = NULL;
+	mode->keymap.info  = NULL;
+	mode->keysyms      = NULL;
+	mode->cur_group    = 0;
 
 	// Allocate Grab Map
-	mode->grabs = (xhd_grablist_t*) malloc( sizeof(xhd_grablist_t) * MAX_GROUPS );
+	mode->grabs = (xhd_grablist_t*) xhd_arena_alloc( arena, sizeof(xhd_grablist_t) * MAX_GROUPS );
 
 	if ( mode->grabs == NULL )
-	{
-		ret = -ENOMEM;
-		goto fail1;
-	}
+		return -ENOMEM;
 
 	for ( i = 0; i < MAX_GROUPS; ++i )
 	{
 		mode->grabs[i].num_grabs   = 0;
 		mode->grabs[i].alloc_grabs = GRAB_LIST_SIZE;
-		mode->grabs[i].list = (xhd_grab_t*) calloc ( GRAB_LIST_SIZE, sizeof(xhd_grab_t) );
+		mode->grabs[i].list = (xhd_grab_t*) xhd_arena_alloc( arena, sizeof(xhd_grab_t) * GRAB_LIST_SIZE );
 
 		if ( mode->grabs[i].list == NULL )
-		{
-			ret = -ENOMEM;
-			goto fail2;
-		}
+			return -ENOMEM;
+	}
+
+	// Allocate Key Map: hot records followed by cold records in one block
+	mode->keymap.keys = (xhd_key_t*) xhd_arena_alloc( arena, ( sizeof(xhd_key_t) + sizeof(xhd_keyinfo_t) ) * XHD_NUM_KEYS );
+
+	if ( mode->keymap.keys == NULL )
+		return -ENOMEM;
+
+	mode->keymap.info = (xhd_keyinfo_t*) ( mode->keymap.keys + XHD_NUM_KEYS );
+
+	return 0;
+}
+
+/**
+ * XHD Modes New Action Function
+ *
+ * Creates an empty action in the modelist's arena
+ */
+xhd_action_t* xhd_modes_new_action ( xhd_modelist_t* modelist )
+{
+	xhd_action_t* action = (xhd_action_t*) xhd_arena_alloc( &modelist->arena, sizeof(xhd_action_t) );
+
+	if ( action != NULL )
+		action->next_mode = XHD_NO_MODE;
+
+	return action;
+}
 
-		allocated_grablists++;
+/**
+ * XHD Modes Lookup Action Function
+ *
+ * Finds the action bound to a key event and modifier state in constant time
+ */
+static inline
+xhd_action_t* xhd_modes_lookup_action ( const xhd_key_t* key, uint32_t event, xhd_modifier_t modifier )
+{
+	uint8_t slot;
+
+	if ( key->slots[ event ] == NULL )
+		return NULL;
+
+	// Pointer button bits are not part of a hotkey
+	slot = key->slots[ event ][ modifier & ( XHD_NUM_MODIFIERS - 1 ) ];
+
+	return slot ? key->acts[ slot - 1 ] : NULL;
+}
+
+/**
+ * XHD Modes Init Function
+ *
+ * Initializes the XHD mode list
+ */
+int xhd_modes_init ( xhd_modelist_t* modelist )
+{
+	// Fallback values
+	modelist->cur_mode       = 0;
+	modelist->num_modes      = 0;
+	modelist->alloc_modes    = 0;
+	modelist->modes          = NULL;
+	modelist->num_commands   = 0;
+	modelist->alloc_commands = 0;
+	modelist->commands       = NULL;
+
+	xhd_arena_init( &modelist->arena );
+
+	modelist->modes = (xhd_mode_t*) xhd_arena_alloc( &modelist->arena, sizeof(xhd_mode_t) * MODE_LIST_SIZE );
+
+	if ( modelist->modes == NULL )
+	{
+		fprintf( stderr, "Error initializing mode list.\n" );
+		return -ENOMEM;
 	}
 
-	// Allocate Key Map
-	mode->keymap = (xhd_key_t***) calloc( MAX_GROUPS, sizeof(xhd_key_t**) );
+	modelist->alloc_modes = MODE_LIST_SIZE;
+	return 0;
+}
+
+/**
+ * XHD Modes Fini Function
+ *
+ * Cleans up modelist memory
+ */
+int xhd_modes_fini ( xhd_modelist_t* modelist )
+{
+	uint32_t i;
 
-	if ( mode->keymap == NULL )
+	for ( i = 0; i < modelist->num_modes; ++i )
 	{
-		ret = -ENOMEM;
-		goto fail1;
+		if ( modelist->modes[i].keysyms != NULL )
+			xhd_keysyms_release( modelist->modes[i].keysyms );
 	}
 
-	for ( i = 0; i < MAX_GROUPS; ++i )
+	xhd_plugins_release( modelist );
+	xhd_arena_release( &modelist->arena );
+
+	modelist->cur_mode       = 0;
+	modelist->num_modes      = 0;
+	modelist->alloc_modes    = 0;
+	modelist->modes          = NULL;
+	modelist->num_commands   = 0;
+	modelist->alloc_commands = 0;
+	modelist->commands       = NULL;
+
+	return 0;
+}
+
+/**
+ * XHD Modes Register Mode Function
+ *
+ * Adds a mode called by len characters of name to a modelist
+ */
+int xhd_modes_register_mode ( xhd_modelist_t* modelist, const char* name, uint32_t len )
+{
+	uint32_t i;
+
+	// If no more available slots, allocate more
+	if ( modelist->alloc_modes <= modelist->num_modes )
 	{
-		mode->keymap[i] = (xhd_key_t**) calloc( MAX_KEYCODE, sizeof(xhd_key_t*) );
+		uint32_t    alloc_modes = modelist->alloc_modes * 2 + 1;
+		xhd_mode_t* tmp         = (xhd_mode_t*) xhd_arena_alloc( &modelist->arena, sizeof(xhd_mode_t) * alloc_modes );
 
-		if ( mode->keymap[i] == NULL )
+		if ( tmp == NULL )
 		{
-			ret = -ENOMEM;
-			goto fail2;
+			fprintf( stderr, "Failed to register mode: no memory\n" );
+			return -ENOMEM;
 		}
 
-		allocated_keysets++;
-		allocated_levelsets = 0;
-
-		for ( j = 0; j < MAX_KEYCODE; ++j )
+		for ( i = 0; i < modelist->num_modes; ++i )
 		{
-			mode->keymap[i][j] = (xhd_key_t*) calloc( MAX_LEVELS, sizeof(xhd_key_t) );
+			tmp[i] = modelist->modes[i];
+		}
 
-			if ( mode->keymap[i][j] == NULL )
-			{
-				ret = -ENOMEM;
-				goto fail2;
-			}
+		modelist->modes       = tmp;
+		modelist->alloc_modes = alloc_modes;
+	}
 
-			allocated_levelsets++;
-		}
+	xhd_mode_t* mode = &modelist->modes[ modelist->num_modes ];
+
+	if ( xhd_modes_alloc_mode( &modelist->arena, mode ) )
+	{
+		fprintf( stderr, "Failed to allocate mode.\n" );
+		return -ENOMEM;
 	}
 
-	goto exit;
+	mode->name = xhd_arena_strndup( &modelist->arena, name, len );
 
-	fail4:
-		for ( i = 0; i < allocated_keysets - 1; ++i )
-		{
-			for ( j = 0; j < MAX_LEVELS; ++j )
-			{
-				free( mode->keymap[i][j] );
-			}
+	if ( mode->name == NULL )
+		return -ENOMEM;
+
+	// All modes share the symbols of the current keyboard map
+	mode->keysyms = xhd_keysyms_acquire();
 
-			free( mode->keymap[i] );
+	if ( mode->keysyms == NULL )
+	{
+		fprintf( stderr, "Failed to register mode: no keyboard map\n" );
+		return -1;
+	}
+
+	modelist->num_modes++;
+	return 0;
+}
+
+static inline
+uint32_t xhd_modes_grab_key ( const xhd_grab_t* grab )
+{
+	return ( (uint32_t) grab->keycode << 16 ) | grab->modifier;
+}
+
+/**
+ * XHD Modes Register Grab Function
+ *
+ * Adds a grab to a grab list, unless the list already has it
+ */
+int xhd_modes_register_grab ( xhd_arena_t* arena, xhd_grablist_t* grablist, xhd_keycode_t key_index, xhd_modifier_t modifier )
+{
+	uint32_t i;
+	xhd_grab_t grab = { key_index, modifier };
+
+	// Find the sorted position of the grab
+	uint32_t low  = 0;
+	uint32_t high = grablist->num_grabs;
+
+	while ( low < high )
+	{
+		uint32_t mid = low + ( high - low ) / 2;
+
+		if ( xhd_modes_grab_key( &grablist->list[ mid ] ) < xhd_modes_grab_key( &grab ) )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if ( low < grablist->num_grabs && xhd_modes_grab_key( &grablist->list[ low ] ) == xhd_modes_grab_key( &grab ) )
+		return 0;
+
+	// If no more available slots, allocate more
+	if ( grablist->alloc_grabs <= grablist->num_grabs )
+	{
+		uint32_t    alloc_grabs = grablist->alloc_grabs * 2 + 2;
+		xhd_grab_t* tmp         = (xhd_grab_t*) xhd_arena_alloc( arena, sizeof(xhd_grab_t) * alloc_grabs );
+
+		if ( tmp == NULL )
+		{
+			fprintf( stderr, "Failed to register grab: no memory\n" );
+			return -ENOMEM;
 		}
 
-		if ( allocated_keysets >= 1 )
+		for ( i = 0; i < grablist->num_grabs; ++i )
 		{
-			for ( i = 0; i < allocated_levelsets; ++i )
-			{
-				free( mode->keymap[allocated_keysets - 1][i] );
-			}
+			tmp[i] = grablist->list[i];
 		}
 
-		free( mode->keymap[allocated_keysets] );
+		grablist->list        = tmp;
+		grablist->alloc_grabs = alloc_grabs;
+	}
 
-	fail3:
-		free( mode->keymap );
+	memmove( &grablist->list[ low + 1 ], &grablist->list[ low ], sizeof(xhd_grab_t) * ( grablist->num_grabs - low ) );
+	grablist->list[ low ] = grab;
+	grablist->num_grabs++;
+	return 0;
+}
 
-	fail2:
-		for ( i = 0; i < allocated_grablists; ++i )
+/**
+ * XHD Modes Diff Grablists Function
+ *
+ * Computes the grabs and ungrabs that turn one sorted grablist into another
+ * The difference is allocated from the arena
+ */
+int xhd_modes_diff_grablists ( xhd_arena_t* arena, const xhd_grablist_t* from, const xhd_grablist_t* to, xhd_grabdiff_t* diff )
+{
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	diff->ungrabs.num_grabs   = 0;
+	diff->ungrabs.alloc_grabs = from->num_grabs;
+	diff->ungrabs.list        = (xhd_grab_t*) xhd_arena_alloc( arena, sizeof(xhd_grab_t) * ( from->num_grabs + 1 ) );
+	diff->grabs.num_grabs     = 0;
+	diff->grabs.alloc_grabs   = to->num_grabs;
+	diff->grabs.list          = (xhd_grab_t*) xhd_arena_alloc( arena, sizeof(xhd_grab_t) * ( to->num_grabs + 1 ) );
+
+	if ( diff->ungrabs.list == NULL || diff->grabs.list == NULL )
+	{
+		fprintf( stderr, "Failed to diff grabs: no memory\n" );
+		return -ENOMEM;
+	}
+
+	// Both lists are sorted, so one merge pass finds the difference
+	while ( i < from->num_grabs || j < to->num_grabs )
+	{
+		if ( j >= to->num_grabs
+		     || ( i < from->num_grabs && xhd_modes_grab_key( &from->list[i] ) < xhd_modes_grab_key( &to->list[j] ) ) )
 		{
-			free( mode->grabs[i].list );
-			mode->grabs[i].alloc_grabs = 0;
+			diff->ungrabs.list[ diff->ungrabs.num_grabs++ ] = from->list[ i++ ];
 		}
+		else if ( i >= from->num_grabs
+		          || xhd_modes_grab_key( &to->list[j] ) < xhd_modes_grab_key( &from->list[i] ) )
+		{
+			diff->grabs.list[ diff->grabs.num_grabs++ ] = to->list[ j++ ];
+		}
+		else
+		{
+			i++;
+			j++;
+		}
+	}
 
-	fail1:
-		free( mode->grabs );
-
-	exit:
-		return ret;
+	return 0;
 }
 
 /**
- * XHD Modes Free Mode Function
+ * XHD Modes Build Deltas Function
  *
- * Cleans up mode memory
+ * Precomputes the grab difference between every pair of groups of a mode
+ * Must run once the mode's grablists are complete
  */
-int xhd_modes_free_mode ( xhd_mode_t* mode )
+int xhd_modes_build_deltas ( xhd_arena_t* arena, xhd_mode_t* mode )
 {
-	int i, j, k, l, m;
+	uint32_t i, j;
 
-	for ( i = 0; i < MAX_GROUPS; ++i )
-		free( mode->grabs[i].list );
+	mode->deltas = (xhd_grabdiff_t*) xhd_arena_alloc( arena, sizeof(xhd_grabdiff_t) * MAX_GROUPS * MAX_GROUPS );
 
-	free( mode->grabs );
+	if ( mode->deltas == NULL )
+	{
+		fprintf( stderr, "Failed to build group deltas: no memory\n" );
+		return -ENOMEM;
+	}
 
 	for ( i = 0; i < MAX_GROUPS; ++i )
 	{
-		for ( j = 0; j < MAX_KEYCODE; ++j )
+		for ( j = 0; j < MAX_GROUPS; ++j )
 		{
-			for ( k = 0; k < MAX_LEVELS; ++k )
-			{
-				for ( l = 0; l < mode->keymap[i][j][k].num_acts; ++l )
-				{
-					for ( m = 0; m < mode->keymap[i][j][k].acts[l].num_cmds; ++m )
-					{
-						free( mode->keymap[i][j][k].acts[l].cmds[m] );
-					}
-					free( mode->keymap[i][j][k].acts[l].cmds );
-				}
-				free( mode->keymap[i][j][k].acts );
-			}
-			free( mode->keymap[i][j] );
+			if ( xhd_modes_diff_grablists( arena, &mode->grabs[i], &mode->grabs[j],
+			                               &mode->deltas[ XHD_DELTA_INDEX( i, j ) ] ) )
+				return -ENOMEM;
 		}
-		free( mode->keymap[i] );
 	}
-	free( mode->keymap );
 
 	return 0;
 }
 
 /**
- * XHD Modes Init Function
+ * XHD Modes Find Mode Function
  *
- * Initializes the XHD mode list
+ * Returns the index of the mode called name, or XHD_NO_MODE
  */
-int xhd_modes_init ( xhd_modelist_t* modelist )
+uint32_t xhd_modes_find_mode ( const xhd_modelist_t* modelist, const char* name )
 {
-	int ret = 0;
 	uint32_t i;
-	uint32_t j;
 
-	// Fallback values
-	modelist->cur_mode    = 0;
-	modelist->num_modes   = 0;
-	modelist->alloc_modes = 0;
-	modelist->modes       = NULL;
+	for ( i = 0; i < modelist->num_modes; ++i )
+	{
+		if ( strcmp( modelist->modes[i].name, name ) == 0 )
+			return i;
+	}
 
-	modelist->modes = (xhd_mode_t*) malloc( sizeof(xhd_mode_t) * MODE_LIST_SIZE );
+	return XHD_NO_MODE;
+}
 
-	if ( modelist->modes == NULL )
+/**
+ * XHD Modes Build Switch Function
+ *
+ * Computes the grab difference from one mode to another for every group,
+ * unless it is already known
+ */
+int xhd_modes_build_switch ( xhd_modelist_t* modelist, uint32_t from_index, uint32_t to_index )
+{
+	uint32_t    k;
+	xhd_mode_t* from = &modelist->modes[ from_index ];
+
+	if ( to_index >= from->num_switches || from->switches[ XHD_SWITCH_INDEX( to_index, 0 ) ].grabs.list != NULL )
+		return 0;
+
+	for ( k = 0; k < MAX_GROUPS; ++k )
 	{
-		fprintf( stderr, "Error initializing mode list.\n" );
-		ret = -ENOMEM;
-		goto fail1;
+		if ( xhd_modes_diff_grablists( &modelist->arena, &from->grabs[k], &modelist->modes[ to_index ].grabs[k],
+		                               &from->switches[ XHD_SWITCH_INDEX( to_index, k ) ] ) )
+			return -ENOMEM;
 	}
 
-	for ( i = 0; i < MODE_LIST_SIZE; ++i )
+	return 0;
+}
+
+/**
+ * XHD Modes Resolve Switch Function
+ *
+ * Resolves the mode switch of one of a mode's actions by name
+ * and precomputes its grab difference
+ */
+static
+int xhd_modes_resolve_switch ( xhd_modelist_t* modelist, uint32_t mode_index, xhd_action_t* action )
+{
+	xhd_mode_t* mode = &modelist->modes[ mode_index ];
+
+	// Shared actions are resolved once
+	if ( action->next_name == NULL || action->next_mode != XHD_NO_MODE )
+		return 0;
+
+	action->next_mode = xhd_modes_find_mode( modelist, action->next_name );
+
+	if ( action->next_mode == XHD_NO_MODE )
 	{
-		ret = xhd_modes_alloc_mode( &modelist->modes[i] );
+		fprintf( stderr, "Unknown mode %s in mode %s\n", action->next_name, mode->name );
+		return -1;
+	}
 
-		if ( ret )
-		{
-			fprintf( stderr, "Error allocating memory for a mode.\n" );
-			goto fail2;
-		}
+	// A switch to the same mode changes nothing
+	if ( action->next_mode == mode_index )
+		return 0;
+
+	return xhd_modes_build_switch( modelist, mode_index, action->next_mode );
+}
 
-		modelist->alloc_modes++;
+/**
+ * XHD Modes Build Switches Function
+ *
+ * Resolves the mode switches of a mode's actions by name,
+ * then precomputes the grab difference to each target mode for every group
+ */
+int xhd_modes_build_switches ( xhd_modelist_t* modelist, uint32_t mode_index )
+{
+	uint32_t i, j;
+	xhd_mode_t* mode = &modelist->modes[ mode_index ];
+
+	mode->num_switches = modelist->num_modes;
+	mode->switches     = (xhd_grabdiff_t*) xhd_arena_alloc( &modelist->arena, sizeof(xhd_grabdiff_t) * modelist->num_modes * MAX_GROUPS );
+
+	if ( mode->switches == NULL )
+	{
+		fprintf( stderr, "Failed to build mode switches: no memory\n" );
+		mode->num_switches = 0;
+		return -ENOMEM;
 	}
 
-	goto exit;
+	for ( i = 0; i < XHD_NUM_KEYS; ++i )
+	{
+		xhd_key_t* key = &mode->keymap.keys[i];
 
-	fail2:
-		for ( j = 0; j < i; ++j )
+		for ( j = 0; j < key->num_acts; ++j )
 		{
-			if ( xhd_modes_free_mode( &modelist->modes[j] ) )
-			{
-				fprintf( stderr, "Failing; failed to handle error.\n" );
+			if ( xhd_modes_resolve_switch( modelist, mode_index, key->acts[j] ) )
 				return -1;
-			}
 		}
+	}
+
+	for ( i = 0; i < mode->num_named; ++i )
+	{
+		if ( xhd_modes_resolve_switch( modelist, mode_index, mode->named[i] ) )
+			return -1;
+	}
+
+	// Completing a key sequence returns to its root
+	if ( mode->root != XHD_NO_MODE )
+		return xhd_modes_build_switch( modelist, mode_index, mode->root );
 
-	fail1:
-	exit:
-		return ret;
+	return 0;
 }
 
 /**
- * XHD Modes Fini Function
+ * XHD Modes Finalize Function
  *
- * Cleans up modelist memory
+ * Precomputes the runtime tables of every mode once the config is loaded
  */
-int xhd_modes_fini ( xhd_modelist_t* modelist )
+int xhd_modes_finalize ( xhd_modelist_t* modelist )
 {
-	int ret = 0;
 	uint32_t i;
 
-	for ( i = 0; i < modelist->alloc_modes; ++i )
+	for ( i = 0; i < modelist->num_modes; ++i )
 	{
-		if ( xhd_modes_free_mode( &modelist->modes[i] ) )
-		{
-			fprintf( stderr, "Failing; failed to handle error.\n" );
+		if ( xhd_modes_build_deltas( &modelist->arena, &modelist->modes[i] ) )
 			return -1;
-		}
-	}
 
-	free( modelist->modes );
+		if ( xhd_modes_build_switches( modelist, i ) )
+			return -1;
+	}
 
-	modelist->cur_mode    = 0;
-	modelist->num_modes   = 0;
-	modelist->alloc_modes = 0;
-	modelist->modes       = NULL;
+	return 0;
 }
 
 /**
- * XHD Modes Keymap Init Function
- *
- * Retrieves and parses X keymap
- * Organizes data into XHD keymap
+ * XHD Modes Register Action Function
  *
- * TODO: only do calculation once
+ * Binds a shared action to a key event and modifier
+ * A later action with the same event and modifier replaces the earlier one
  */
-int xhd_modes_keymap_init ( xhd_mode_t* mode )
+int xhd_modes_register_action ( xhd_arena_t* arena, xhd_keymap_t* keymap, uint32_t key_index, uint32_t event, xhd_modifier_t modifier, xhd_action_t* action )
 {
-	int ret = 0;
-	uint32_t key_index;
-	uint32_t level_index;
-	uint32_t group_index;
-	uint32_t max_groups;
-	uint32_t max_levels;
-
-	xkb_keysym_t* keysym;
+	uint32_t i;
 
-	// Get Core Keyboard
-	int32_t device_id = xkb_x11_get_core_keyboard_device_id( conn );
+	xhd_key_t*     key  = &keymap->keys[ key_index ];
+	xhd_keyinfo_t* info = &keymap->info[ key_index ];
 
-	if ( device_id == -1 )
+	if ( modifier >= XHD_NUM_MODIFIERS )
 	{
-		ret = -1;
-		goto fail1;
+		fprintf( stderr, "Failed to register action: bad modifier %d\n", modifier );
+		return -EINVAL;
 	}
-	// Get XKB Keymap
-	struct xkb_keymap* keymap = xkb_x11_keymap_new_from_device( ctx, conn, device_id, XKB_KEYMAP_COMPILE_NO_FLAGS );
 
-	if ( ! keymap )
+	if ( event >= XHD_NUM_EVENTS )
 	{
-		ret = -2;
-		goto fail2;
+		fprintf( stderr, "Failed to register action: bad event %u\n", event );
+		return -EINVAL;
 	}
 
-	for ( key_index = 0; key_index < MAX_KEYCODE; ++key_index )
+	// Allocate the dispatch table on first use
+	if ( key->slots[ event ] == NULL )
 	{
-		max_groups = xkb_keymap_num_layouts_for_key( keymap, key_index ) % MAX_GROUPS;
-		for ( group_index = 0; group_index < max_groups; ++group_index )
+		key->slots[ event ] = (uint8_t*) xhd_arena_alloc( arena, sizeof(uint8_t) * XHD_NUM_MODIFIERS );
+
+		if ( key->slots[ event ] == NULL )
 		{
-			max_levels = xkb_keymap_num_levels_for_key( keymap, key_index, group_index );
-			if ( max_levels >= MAX_LEVELS ) max_levels = MAX_LEVELS;
-			for ( level_index = 0; level_index < max_levels; ++level_index )
-			{
-				xkb_keymap_key_get_syms_by_level( keymap, key_index, group_index, level_index, (const xkb_keysym_t**)&keysym );
-				if ( keysym )
-				{
-					mode->keymap[ group_index ][ key_index ][ level_index ].symbol = *keysym;
-				}
-			}
+			fprintf( stderr, "Failed to register action: no memory\n" );
+			return -ENOMEM;
 		}
 	}
 
-	goto exit;
+	uint8_t* slots = key->slots[ event ];
 
-	fail2:
-	fail1:
-	exit:
-		return ret;
-}
+	// Replace an existing binding for the same modifier
+	if ( slots[ modifier ] != 0 )
+	{
+		key->acts[ slots[ modifier ] - 1 ] = action;
+		return 0;
+	}
 
-/**
- * XHD Modes Register Mode Function
- *
- * Adds a mode to a modelist
- */
-int xhd_modes_register_mode ( xhd_modelist_t* modelist, const char* name )
-{
-	uint32_t i = 0;
+	if ( key->num_acts >= UINT8_MAX )
+	{
+		fprintf( stderr, "Failed to register action: too many actions on one key\n" );
+		return -ENOSPC;
+	}
 
 	// If no more available slots, allocate more
-	if ( modelist->alloc_modes <= modelist->num_modes )
+	if ( info->alloc_acts <= key->num_acts )
 	{
-		modelist->alloc_modes *= 2;
-		modelist->alloc_modes += 1;
-		xhd_mode_t* tmp = (xhd_mode_t*) calloc( modelist->alloc_modes, sizeof(xhd_mode_t) );
+		uint32_t       alloc_acts = info->alloc_acts * 2 + 2;
+		xhd_action_t** tmp        = (xhd_action_t**) xhd_arena_alloc( arena, sizeof(xhd_action_t*) * alloc_acts );
 
 		if ( tmp == NULL )
 		{
-			fprintf( stderr, "Failed to register mode: no memory\n" );
-			modelist->alloc_modes -= 1;
-			modelist->alloc_modes /= 2;
+			fprintf( stderr, "Failed to register action: no memory\n" );
 			return -ENOMEM;
 		}
 
-		if ( modelist->num_modes != 0 )
+		for ( i = 0; i < key->num_acts; ++i )
 		{
-			for ( i = 0; i < modelist->num_modes; ++i )
-			{
-				tmp[i].name      = modelist->modes[i].name;
-				tmp[i].grabs     = modelist->modes[i].grabs;
-				tmp[i].keymap    = modelist->modes[i].keymap;
-				tmp[i].cur_group = modelist->modes[i].cur_group;
-			}
+			tmp[i] = key->acts[i];
 		}
 
-		for ( ; i < modelist->alloc_modes; ++i )
-		{
-			if ( xhd_modes_alloc_mode( &modelist->modes[i] ) )
-			{
-				fprintf( stderr, "Failed to allocate mode.\n" );
-				fprintf( stderr, "Failed to handle error.\n" ); // TODO: figure how to handle it
-				return -1;
-			}
-		}
+		key->acts        = tmp;
+		info->alloc_acts = alloc_acts;
+	}
+
+	key->acts[ key->num_acts ] = action;
 
-		free( modelist->modes );
-		modelist->modes = tmp;
+	// Slots hold indices plus one, at most one action per event and modifier state
+	slots[ modifier ] = (uint8_t) ++key->num_acts;
+	return 0;
+}
+
+/**
+ * XHD Modes Resolve Builtin Function
+ *
+ * Points a command written as "@name [arg]" at its builtin,
+ * or one written as "@plugin:handler [arg]" at the plugin's handler
+ */
+int xhd_modes_resolve_builtin ( xhd_command_t* cmd )
+{
+	const xhd_builtin_t* builtin;
+	const char*          name = cmd->line + 1;
+	size_t               len  = strcspn( name, " \t" );
+
+	if ( memchr( name, ':', len ) != NULL )
+		return xhd_plugins_resolve( cmd, name, len );
+
+	for ( builtin = xhd_modes_builtins; builtin != NULL && builtin->name != NULL; ++builtin )
+	{
+		if ( strlen( builtin->name ) == len && strncmp( builtin->name, name, len ) == 0 )
+			break;
 	}
 
-	xhd_modes_keymap_init( &modelist->modes[ modelist->num_modes ] );
-	modelist->modes[ modelist->num_modes++ ].name = strdup( name );
+	if ( builtin == NULL || builtin->name == NULL )
+	{
+		fprintf( stderr, "Unknown builtin: @%.*s\n", (int) len, name );
+		return -EINVAL;
+	}
+
+	const char* arg = name + len + strspn( name + len, " \t" );
+
+	if ( builtin->has_arg != ( arg[0] != '\0' ) )
+	{
+		fprintf( stderr, builtin->has_arg ? "Builtin @%s expects an argument\n" : "Builtin @%s takes no argument\n", builtin->name );
+		return -EINVAL;
+	}
+
+	cmd->builtin = builtin->fn;
+	cmd->arg     = arg;
 	return 0;
 }
 
 /**
- * XHD Modes Register Grab Function
+ * XHD Modes Intern Command Function
  *
- * Adds a grab to a grab list
+ * Returns the modelist's command for len characters of a line,
+ * preparing it on first use
+ */
+xhd_command_t* xhd_modes_intern_command ( xhd_modelist_t* modelist, const char* line, uint32_t len )
+{
+	uint32_t i;
+	uint32_t hash = xhd_arena_hash( line, len );
+
+	// Keep the table at most half full
+	if ( ( modelist->num_commands + 1 ) * 2 > modelist->alloc_commands )
+	{
+		uint32_t        alloc_commands = modelist->alloc_commands ? modelist->alloc_commands * 2 : 64;
+		xhd_command_t** tmp            = (xhd_command_t**) xhd_arena_alloc( &modelist->arena, sizeof(xhd_command_t*) * alloc_commands );
+
+		if ( tmp == NULL )
+			return NULL;
+
+		for ( i = 0; i < modelist->alloc_commands; ++i )
+		{
+			xhd_command_t* cmd = modelist->commands[i];
+			uint32_t       pos;
+
+			if ( cmd == NULL )
+				continue;
+
+			for ( pos = xhd_arena_hash( cmd->line, strlen( cmd->line ) ) & ( alloc_commands - 1 ); tmp[ pos ] != NULL; pos = ( pos + 1 ) & ( alloc_commands - 1 ) );
+
+			tmp[ pos ] = cmd;
+		}
+
+		modelist->commands       = tmp;
+		modelist->alloc_commands = alloc_commands;
+	}
+
+	for ( i = hash & ( modelist->alloc_commands - 1 ); modelist->commands[i] != NULL; i = ( i + 1 ) & ( modelist->alloc_commands - 1 ) )
+	{
+		const char* other = modelist->commands[i]->line;
+
+		if ( strncmp( other, line, len ) == 0 && other[ len ] == '\0' )
+			return modelist->commands[i];
+	}
+
+	xhd_command_t* cmd = (xhd_command_t*) xhd_arena_alloc( &modelist->arena, sizeof(xhd_command_t) );
+
+	if ( cmd == NULL || xhd_exec_prepare( &modelist->arena, cmd, line, len ) )
+		return NULL;
+
+	if ( cmd->line[0] == '@' && xhd_modes_resolve_builtin( cmd ) )
+		return NULL;
+
+	modelist->commands[i] = cmd;
+	modelist->num_commands++;
+	return cmd;
+}
+
+/**
+ * XHD Modes Register Command Function
  *
- * TODO: Search Grab list for same grab and avoid adding
+ * Registers len characters of a command line with an action
  */
-int xhd_modes_register_grab ( xhd_grablist_t* grablist, xhd_keycode_t key_index, xhd_modifier_t modifier )
+int xhd_modes_register_command ( xhd_modelist_t* modelist, xhd_action_t* action, const char* line, uint32_t len )
 {
 	uint32_t i;
 
 	// If no more available slots, allocate more
-	if ( grablist->alloc_grabs <= grablist->num_grabs )
+	if ( action->alloc_cmds <= action->num_cmds )
 	{
-		grablist->alloc_grabs *= 2;
-		grablist->alloc_grabs += 2;
-		xhd_grab_t* tmp = (xhd_grab_t*) calloc( grablist->alloc_grabs, sizeof(xhd_grab_t) );
+		uint32_t        alloc_cmds = action->alloc_cmds * 2 + 2;
+		xhd_command_t** tmp        = (xhd_command_t**) xhd_arena_alloc( &modelist->arena, sizeof(xhd_command_t*) * alloc_cmds );
 
 		if ( tmp == NULL )
 		{
-			fprintf( stderr, "Failed to register grab: no memory\n" );
-			grablist->alloc_grabs -= 2;
-			grablist->alloc_grabs /= 2;
+			fprintf( stderr, "Failed to register command: no memory\n" );
 			return -ENOMEM;
 		}
 
-		if ( grablist->num_grabs != 0 )
+		for ( i = 0; i < action->num_cmds; ++i )
 		{
-			for ( i = 0; i < grablist->num_grabs; ++i )
-			{
-				tmp[i].modifier = grablist->list[i].modifier;
-				tmp[i].keycode  = grablist->list[i].keycode;
-			}
+			tmp[i] = action->cmds[i];
 		}
 
-		free( grablist->list );
-		grablist->list = tmp;
+		action->cmds       = tmp;
+		action->alloc_cmds = alloc_cmds;
 	}
 
-	grablist->list[ grablist->num_grabs ].keycode  = key_index;
-	grablist->list[ grablist->num_grabs ].modifier = modifier;
-	grablist->num_grabs++;
+	action->cmds[ action->num_cmds ] = xhd_modes_intern_command( modelist, line, len );
+
+	if ( action->cmds[ action->num_cmds ] == NULL )
+		return -1;
+
+	action->num_cmds++;
 	return 0;
 }
 
 /**
- * XHD Modes Register Action Function
+ * XHD Modes Join Commands Function
  *
- * Registers an action with a key
- *
- * TODO: Search the key actions for the same modifier to overwrite rather than create a new one
+ * Replaces the commands of an action with one shell script running them in turn
+ * Builtins stay separate commands, run after the script is started
  */
-int xhd_modes_register_action ( xhd_key_t* key, xhd_action_t* action )
+int xhd_modes_join_commands ( xhd_modelist_t* modelist, xhd_action_t* action )
 {
-	uint32_t i;
+	uint32_t i, j;
+	uint32_t num_shell = 0;
+	size_t   len       = 0;
 
-	// If no more available slots, allocate more
-	if ( key->alloc_acts <= key->num_acts )
+	for ( i = 0; i < action->num_cmds; ++i )
 	{
-		key->alloc_acts *= 2;
-		key->alloc_acts += 2;
-		xhd_action_t* tmp = (xhd_action_t*) calloc( key->alloc_acts, sizeof(xhd_action_t) );
-
-		if ( tmp == NULL )
+		if ( action->cmds[i]->builtin == NULL )
 		{
-			fprintf( stderr, "Failed to register action: no memory\n" );
-			key->alloc_acts -= 2;
-			key->alloc_acts /= 2;
-			return -ENOMEM;
+			len += strlen( action->cmds[i]->line ) + 1;
+			num_shell++;
 		}
+	}
+
+	if ( num_shell < 2 )
+		return 0;
+
+	uint32_t        alloc_cmds = action->num_cmds - num_shell + 1;
+	xhd_command_t** cmds       = (xhd_command_t**) xhd_arena_alloc( &modelist->arena, sizeof(xhd_command_t*) * alloc_cmds );
+	char*           script     = (char*) xhd_arena_alloc( &modelist->arena, len );
+
+	if ( cmds == NULL || script == NULL )
+	{
+		fprintf( stderr, "Failed to join commands: no memory\n" );
+		return -ENOMEM;
+	}
 
-		if ( key->num_acts != 0 )
+	// One command per line, the newline makes it a shell command
+	for ( i = 0, j = 1, len = 0; i < action->num_cmds; ++i )
+	{
+		if ( action->cmds[i]->builtin != NULL )
 		{
-			for ( i = 0; i < key->num_acts; ++i )
-			{
-				tmp[i].mod      = key->acts[i].mod;
-				tmp[i].num_cmds = key->acts[i].num_cmds;
-				tmp[i].cmds     = key->acts[i].cmds;
-			}
+			cmds[ j++ ] = action->cmds[i];
+			continue;
 		}
 
-		free( key->acts );
-		key->acts = tmp;
+		size_t line_len = strlen( action->cmds[i]->line );
+
+		memcpy( script + len, action->cmds[i]->line, line_len );
+		script[ len + line_len ] = '\n';
+		len += line_len + 1;
 	}
 
-	key->acts[ key->num_acts++ ] = *action;
+	xhd_command_t* cmd = xhd_modes_intern_command( modelist, script, len - 1 );
+
+	if ( cmd == NULL )
+		return -ENOMEM;
+
+	cmds[0] = cmd;
+
+	action->cmds       = cmds;
+	action->num_cmds   = j;
+	action->alloc_cmds = alloc_cmds;
 	return 0;
 }
 
 /**
- * XHD Modes Register Command Function
+ * XHD Modes Register Name Function
  *
- * Registers a command with an action
+ * Makes a named action runnable by name in a mode
+ * A later action with the same name replaces the earlier one
  */
-int xhd_modes_register_command ( xhd_action_t* action, const char* cmd )
+int xhd_modes_register_name ( xhd_arena_t* arena, xhd_mode_t* mode, xhd_action_t* action )
 {
 	uint32_t i;
 
+	for ( i = 0; i < mode->num_named; ++i )
+	{
+		if ( strcmp( mode->named[i]->name, action->name ) == 0 )
+		{
+			mode->named[i] = action;
+			return 0;
+		}
+	}
+
 	// If no more available slots, allocate more
-	if ( action->alloc_cmds <= action->num_cmds )
+	if ( mode->alloc_named <= mode->num_named )
 	{
-		action->alloc_cmds *= 2;
-		action->alloc_cmds += 2;
-		char** tmp = (char**) calloc( action->alloc_cmds, sizeof(char*) );
+		uint32_t       alloc_named = mode->alloc_named * 2 + 4;
+		xhd_action_t** tmp         = (xhd_action_t**) xhd_arena_alloc( arena, sizeof(xhd_action_t*) * alloc_named );
 
 		if ( tmp == NULL )
 		{
-			fprintf( stderr, "Failed to register command: no memory\n" );
-			action->alloc_cmds -= 2;
-			action->alloc_cmds /= 2;
+			fprintf( stderr, "Failed to register name: no memory\n" );
 			return -ENOMEM;
 		}
 
-		if ( action->num_cmds != 0 )
+		for ( i = 0; i < mode->num_named; ++i )
 		{
-			for ( i = 0; i < action->num_cmds; ++i )
-			{
-				tmp[i] = action->cmds[i];
-			}
+			tmp[i] = mode->named[i];
 		}
 
-		free( action->cmds );
-		action->cmds = tmp;
+		mode->named       = tmp;
+		mode->alloc_named = alloc_named;
 	}
 
-	action->cmds[ action->num_cmds++ ] = strdup( cmd );
+	mode->named[ mode->num_named++ ] = action;
 	return 0;
 }
 
+/**
+ * XHD Modes Find Named Function
+ *
+ * Finds the action called name, preferring the current mode
+ * Stores the index of the mode it belongs to in mode_index
+ */
+xhd_action_t* xhd_modes_find_named ( const xhd_modelist_t* modelist, const char* name, uint32_t* mode_index )
+{
+	uint32_t i, j;
+
+	for ( i = 0; i < modelist->num_modes; ++i )
+	{
+		// The current mode first, then the others in order
+		uint32_t          index = i == 0 ? modelist->cur_mode : ( i <= modelist->cur_mode ? i - 1 : i );
+		const xhd_mode_t* mode  = &modelist->modes[ index ];
+
+		for ( j = 0; j < mode->num_named; ++j )
+		{
+			if ( strcmp( mode->named[j]->name, name ) == 0 )
+			{
+				*mode_index = index;
+				return mode->named[j];
+			}
+		}
+	}
+
+	return NULL;
+}
+
 /**
  * XHD Modes Add Action Function
  *
- * Associates an action with a keysym and modifier value
+ * Associates an action with a key event on a keysym and modifier value
+ * Every key and group producing the keysym shares the action
  */
-int xhd_modes_add_action ( xhd_mode_t* mode, xkb_keysym_t keysym, xhd_action_t* action )
+int xhd_modes_add_action ( xhd_modelist_t* modelist, xhd_mode_t* mode, xkb_keysym_t keysym, xhd_modifier_t modifier, uint32_t event, xhd_action_t* action )
 {
 	uint32_t key_index;
 	uint32_t group_index;
 	uint32_t level_index;
 
+	const xhd_symindex_t* index = &mode->keysyms->index;
+	const xhd_symentry_t* entry = xhd_keysyms_find( index, keysym );
+	const xhd_symentry_t* end   = &index->entries[ index->num_entries ];
+
 	// Looks up corresponding key codes
-	for ( group_index = 0; group_index < MAX_GROUPS; ++group_index )
+	for ( ; entry < end && entry->symbol == keysym; ++entry )
 	{
-		for ( key_index = 0; key_index < MAX_KEYCODE; ++key_index )
-		{
-			for ( level_index = 0; level_index < MAX_LEVELS; ++level_index )
-			{
-				if ( keysym == mode->keymap[group_index][key_index][level_index].symbol )
-				{
-					// Auto-add shift level to shifted characters
-					if ( level_index != 0 )
-						action->mod |= 1; // TODO: Make proper defined Shift Bit
+		xhd_modifier_t mod = modifier;
 
-					if ( (action->mod & 1) == 1 )
-						level_index = 1; // TODO this seems sloppy
+		group_index = XHD_KEY_GROUP( entry->key_index );
+		key_index   = XHD_KEY_KEYCODE( entry->key_index );
+		level_index = XHD_KEY_LEVEL( entry->key_index );
 
-					// Registers command with key code and modifier combination
-					xhd_modes_register_action( &mode->keymap[group_index][key_index][level_index], action );
+		// Auto-add shift level to shifted characters
+		if ( level_index != 0 )
+			mod |= 1; // TODO: Make proper defined Shift Bit
 
-					// Adds to correct grab list
-					xhd_modes_register_grab( &mode->grabs[group_index], key_index, action->mod );
-				}
-			}
-		}
+		if ( (mod & 1) == 1 )
+			level_index = 1; // TODO this seems sloppy
+
+		// Registers command with key code and modifier combination
+		if ( xhd_modes_register_action( &modelist->arena, &mode->keymap, XHD_KEY_INDEX( group_index, key_index, level_index ), event, mod, action ) )
+			return -1;
+
+		// Adds to correct grab list
+		if ( xhd_modes_register_grab( &modelist->arena, &mode->grabs[group_index], key_index, mod ) )
+			return -1;
 	}
 	return 0;
 }
 
+/**
+ * XHD Modes Find Action Function
+ *
+ * Returns the action a key event on a keysym and modifier value is bound to,
+ * the way xhd_modes_add_action binds it, or NULL
+ */
+xhd_action_t* xhd_modes_find_action ( const xhd_mode_t* mode, xkb_keysym_t keysym, xhd_modifier_t modifier, uint32_t event )
+{
+	const xhd_symindex_t* index = &mode->keysyms->index;
+	const xhd_symentry_t* entry = xhd_keysyms_find( index, keysym );
+	const xhd_symentry_t* end   = &index->entries[ index->num_entries ];
+
+	for ( ; entry < end && entry->symbol == keysym; ++entry )
+	{
+		xhd_modifier_t mod   = modifier;
+		uint32_t       level = XHD_KEY_LEVEL( entry->key_index );
+
+		if ( level != 0 )
+			mod |= 1;
+
+		if ( (mod & 1) == 1 )
+			level = 1;
+
+		const xhd_key_t* key    = &mode->keymap.keys[ XHD_KEY_INDEX( XHD_KEY_GROUP( entry->key_index ), XHD_KEY_KEYCODE( entry->key_index ), level ) ];
+		xhd_action_t*    action = xhd_modes_lookup_action( key, event, mod );
+
+		if ( action != NULL )
+			return action;
+	}
+
+	return NULL;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef XHD_PLUGIN_H
+#define XHD_PLUGIN_H
+
+#include <stdint.h>
+
+/**
+ * The XHD Plugin Interface
+ *
+ * A plugin is a shared object exporting XHD_PLUGIN_ENTRY, a function
+ * returning its xhd_plugin_t. The config runs one of its handlers with a
+ * command written as "@plugin:handler [arg]", without starting a process.
+ *
+ * This header is all a plugin needs. It only ever changes compatibly;
+ * anything else bumps XHD_PLUGIN_ABI_VERSION, and xhd refuses plugins
+ * built for another version.
+ *
+ * Plugins are loaded once and stay loaded until xhd exits, across reloads.
+ * init, fini, prepare and release are called from the event loop.
+ * run is called from the event loop too, unless the handler has
+ * XHD_PLUGIN_THREAD; then it is called from a single worker thread,
+ * one call after another in the order the keys were pressed.
+ * A handler run in the event loop must not block.
+ */
+#define XHD_PLUGIN_ABI_VERSION 1
+#define XHD_PLUGIN_ENTRY       "xhd_plugin_entry"
+
+// Handler flags
+#define XHD_PLUGIN_THREAD 0x1	// Run on the worker thread instead of the event loop
+
+/**
+ * An XHD Plugin Handler
+ *
+ * One operation of a plugin
+ */
+typedef struct xhd_plugin_handler_t
+{
+	const char* name;		// The name after the ':'
+	uint32_t    flags;		// See XHD_PLUGIN_THREAD
+
+	// Prepares the argument once, when the config is loaded; may be NULL,
+	// then the cookie is the argument itself, "" if there is none.
+	// Returns 0 on success, the config fails to load otherwise
+	int  (*prepare)( void* state, const char* arg, void** cookie );
+
+	// Runs the handler; returns 0 on success, anything else stops a --serial action
+	int  (*run)( void* state, void* cookie );
+
+	// Frees what prepare made, when the config is unloaded; may be NULL
+	void (*release)( void* state, void* cookie );
+
+} xhd_plugin_handler_t;
+
+/**
+ * An XHD Plugin
+ *
+ * What XHD_PLUGIN_ENTRY returns, it must stay valid while the plugin is loaded
+ */
+typedef struct xhd_plugin_t
+{
+	uint32_t    abi_version;	// XHD_PLUGIN_ABI_VERSION
+	const char* name;			// For messages
+
+	// Sets up the plugin state once, when it is loaded; may be NULL
+	// Returns 0 on success
+	int  (*init)( void** state );
+
+	// Tears it down when xhd exits; may be NULL
+	void (*fini)( void* state );
+
+	const xhd_plugin_handler_t* handlers;	// Ended by a handler without a name
+
+} xhd_plugin_t;
+
+typedef const xhd_plugin_t* (*xhd_plugin_entry_fn_t)( void );
+
+#endif
@@ -0,0 +1,656 @@
+#ifndef XHD_PLUGINS_LIB_H
+#define XHD_PLUGINS_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "xhd_types.h"
+#include "xhd_arena.h"
+#include "xhd_plugin.h"
+
+/**
+ * A Loaded Plugin
+ *
+ * Plugins stay loaded until xhd exits, so a reload keeps their state
+ * and the handlers of the old config stay valid until it is released
+ */
+typedef struct xhd_plugin_slot_t
+{
+	char*               name;		// As the config names it
+	void*               handle;		// From dlopen
+	const xhd_plugin_t* plugin;		// From its entry function
+	void*               state;		// From its init
+
+} xhd_plugin_slot_t;
+
+uint32_t           xhd_plugins_num   = 0;
+uint32_t           xhd_plugins_alloc = 0;
+xhd_plugin_slot_t* xhd_plugins       = NULL;
+
+// Presses beyond this many waiting or unreported runs are dropped
+#define XHD_PLUGINS_QUEUE_SIZE 64
+
+/**
+ * A Worker Thread Job
+ *
+ * One handler run, and where its action goes on once it is done
+ */
+typedef struct xhd_plugin_job_t
+{
+	const xhd_command_t* cmd;		// The command to run, its config is kept until the job finished
+	xhd_action_t*        action;	// The action it counts as running for, NULL if none or detached
+	uint32_t             step;		// Its step in that action
+	int                  ret;		// What the handler returned, once it ran
+
+} xhd_plugin_job_t;
+
+/**
+ * A Retired Config
+ *
+ * The commands of a released modelist that queued jobs may still run,
+ * kept until the worker thread finished those jobs
+ */
+typedef struct xhd_plugin_retired_t
+{
+	xhd_arena_t                  arena;				// Holds the commands
+	xhd_command_t**              commands;
+	uint32_t                     alloc_commands;
+	uint64_t                     after;				// Released once this many jobs finished
+	struct xhd_plugin_retired_t* next;
+
+} xhd_plugin_retired_t;
+
+/**
+ * The Worker Thread
+ *
+ * Runs the XHD_PLUGIN_THREAD handlers in order, started on first use.
+ * Every finished run is signalled through xhd_plugins_fd, so the event loop
+ * accounts and continues its action and frees retired configs, see xhd_plugins_receive
+ */
+typedef struct xhd_plugin_worker_t
+{
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   wake;		// Signalled when a job is queued or the worker stops
+	pthread_cond_t   idle;		// Signalled when a job is done
+	int              started;
+	int              stopping;
+	int              busy;		// Whether a job is being run
+	xhd_plugin_job_t current;	// The job being run
+	uint32_t         head;		// The next job to run
+	uint32_t         num_jobs;	// The number of jobs waiting
+	xhd_plugin_job_t jobs[ XHD_PLUGINS_QUEUE_SIZE ];
+	uint32_t         done_head;	// The next finished job to report
+	uint32_t         num_done;	// The number of finished jobs not yet reported
+	xhd_plugin_job_t done[ XHD_PLUGINS_QUEUE_SIZE ];
+	uint64_t         num_queued;	// Jobs queued since the start
+	uint64_t         num_finished;	// Jobs finished since the start
+
+} xhd_plugin_worker_t;
+
+xhd_plugin_worker_t xhd_plugins_worker = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+// Only touched from the event loop
+xhd_plugin_retired_t* xhd_plugins_retired = NULL;
+
+// Readable when the worker finished a job of a serial action
+int xhd_plugins_fd = -1;
+
+/**
+ * XHD Plugins Init Function
+ *
+ * Opens the eventfd the worker thread reports finished jobs through
+ */
+int xhd_plugins_init ( void )
+{
+	xhd_plugins_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+	if ( xhd_plugins_fd < 0 )
+	{
+		fprintf( stderr, "Failed to create the plugin eventfd: %s\n", strerror( errno ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Plugins Threaded Function
+ *
+ * Whether a command runs on the worker thread
+ */
+static inline
+int xhd_plugins_threaded ( const xhd_command_t* cmd )
+{
+	return cmd->handler != NULL && ( cmd->handler->flags & XHD_PLUGIN_THREAD );
+}
+
+/**
+ * XHD Plugins Default Directory Function
+ *
+ * Writes where plugins named without a path are found:
+ * $XDG_CONFIG_HOME/xhd/plugins, else $HOME/.config/xhd/plugins
+ */
+int xhd_plugins_default_dir ( char* dir, size_t len )
+{
+	char* config_home = getenv( "XDG_CONFIG_HOME" );
+
+	if ( config_home != NULL && config_home[0] != '\0' )
+	{
+		snprintf( dir, len, "%s/%s", config_home, "xhd/plugins" );
+		return 0;
+	}
+
+	config_home = getenv( "HOME" );
+
+	if ( config_home == NULL )
+		return -1;
+
+	snprintf( dir, len, "%s/%s", config_home, ".config/xhd/plugins" );
+	return 0;
+}
+
+/**
+ * XHD Plugins Open Function
+ *
+ * Returns the plugin called by len characters of name, loading it on first use
+ * A name with a '/' is the path of the shared object, others are NAME.so
+ * in the default directory
+ */
+xhd_plugin_slot_t* xhd_plugins_open ( const char* name, size_t len )
+{
+	uint32_t i;
+	char     path[ PATH_MAX ];
+	void*    handle = NULL;
+	void*    state  = NULL;
+
+	for ( i = 0; i < xhd_plugins_num; ++i )
+	{
+		if ( strncmp( xhd_plugins[i].name, name, len ) == 0 && xhd_plugins[i].name[ len ] == '\0' )
+			return &xhd_plugins[i];
+	}
+
+	if ( memchr( name, '/', len ) != NULL )
+	{
+		snprintf( path, sizeof(path), "%.*s", (int) len, name );
+	}
+	else
+	{
+		if ( xhd_plugins_default_dir( path, sizeof(path) ) )
+		{
+			fprintf( stderr, "Error; unable to find the plugin directory.\n" );
+			return NULL;
+		}
+
+		size_t dir_len = strlen( path );
+		snprintf( path + dir_len, sizeof(path) - dir_len, "/%.*s.so", (int) len, name );
+	}
+
+	handle = dlopen( path, RTLD_NOW | RTLD_LOCAL );
+
+	if ( handle == NULL )
+	{
+		fprintf( stderr, "Error; cannot load plugin %.*s: %s\n", (int) len, name, dlerror() );
+		return NULL;
+	}
+
+	xhd_plugin_entry_fn_t entry  = (xhd_plugin_entry_fn_t) dlsym( handle, XHD_PLUGIN_ENTRY );
+	const xhd_plugin_t*   plugin = entry != NULL ? entry() : NULL;
+
+	if ( plugin == NULL )
+	{
+		fprintf( stderr, "Error; %s has no %s\n", path, XHD_PLUGIN_ENTRY );
+		goto fail;
+	}
+
+	if ( plugin->abi_version != XHD_PLUGIN_ABI_VERSION )
+	{
+		fprintf( stderr, "Error; plugin %.*s is built for ABI version %u, not %u\n", (int) len, name, plugin->abi_version, XHD_PLUGIN_ABI_VERSION );
+		goto fail;
+	}
+
+	// If no more available slots, allocate more
+	if ( xhd_plugins_alloc <= xhd_plugins_num )
+	{
+		uint32_t           alloc = xhd_plugins_alloc * 2 + 2;
+		xhd_plugin_slot_t* tmp   = (xhd_plugin_slot_t*) realloc( xhd_plugins, sizeof(xhd_plugin_slot_t) * alloc );
+
+		if ( tmp == NULL )
+			goto fail;
+
+		xhd_plugins       = tmp;
+		xhd_plugins_alloc = alloc;
+	}
+
+	char* slot_name = strndup( name, len );
+
+	if ( slot_name == NULL )
+		goto fail;
+
+	if ( plugin->init != NULL && plugin->init( &state ) )
+	{
+		fprintf( stderr, "Error; plugin %.*s failed to start\n", (int) len, name );
+		free( slot_name );
+		goto fail;
+	}
+
+	xhd_plugin_slot_t* slot = &xhd_plugins[ xhd_plugins_num++ ];
+
+	slot->name   = slot_name;
+	slot->handle = handle;
+	slot->plugin = plugin;
+	slot->state  = state;
+	return slot;
+
+	fail:
+		dlclose( handle );
+		return NULL;
+}
+
+/**
+ * XHD Plugins Worker Function
+ *
+ * The worker thread, runs queued handlers until it is stopped
+ */
+void* xhd_plugins_work ( void* data )
+{
+	xhd_plugin_worker_t* worker = (xhd_plugin_worker_t*) data;
+
+	pthread_mutex_lock( &worker->lock );
+
+	while ( 1 )
+	{
+		while ( worker->num_jobs == 0 && ! worker->stopping )
+			pthread_cond_wait( &worker->wake, &worker->lock );
+
+		if ( worker->num_jobs == 0 )
+			break;
+
+		const xhd_command_t* cmd = worker->jobs[ worker->head ].cmd;
+
+		worker->current = worker->jobs[ worker->head ];
+		worker->head    = ( worker->head + 1 ) % XHD_PLUGINS_QUEUE_SIZE;
+		worker->num_jobs--;
+		worker->busy = 1;
+
+		pthread_mutex_unlock( &worker->lock );
+
+		int ret = cmd->handler->run( cmd->state, cmd->cookie );
+
+		if ( ret )
+			fprintf( stderr, "%s failed: %d\n", cmd->line, ret );
+
+		pthread_mutex_lock( &worker->lock );
+		worker->busy = 0;
+		worker->num_finished++;
+
+		// The action may have been detached by a reload while it ran
+		if ( worker->current.action != NULL )
+		{
+			worker->current.ret = ret;
+			worker->done[ ( worker->done_head + worker->num_done ) % XHD_PLUGINS_QUEUE_SIZE ] = worker->current;
+			worker->num_done++;
+		}
+
+		uint64_t one = 1;
+
+		if ( write( xhd_plugins_fd, &one, sizeof(one) ) < 0 && errno != EAGAIN )
+			fprintf( stderr, "Failed to report %s: %s\n", cmd->line, strerror( errno ) );
+
+		pthread_cond_broadcast( &worker->idle );
+	}
+
+	pthread_mutex_unlock( &worker->lock );
+	return NULL;
+}
+
+/**
+ * XHD Plugins Queue Function
+ *
+ * Hands a handler run to the worker thread, starting it if needed
+ * It counts as running for action until it is received, see xhd_plugins_receive
+ */
+int xhd_plugins_queue ( const xhd_command_t* cmd, xhd_action_t* action, uint32_t step )
+{
+	xhd_plugin_worker_t* worker = &xhd_plugins_worker;
+	int                  ret    = 0;
+
+	pthread_mutex_lock( &worker->lock );
+
+	if ( ! worker->started )
+	{
+		// Signals are left to the event loop's signalfd
+		sigset_t all, old;
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+		ret = -pthread_create( &worker->thread, NULL, xhd_plugins_work, worker );
+		pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+		if ( ret )
+		{
+			fprintf( stderr, "Failed to start the plugin thread: %s\n", strerror( -ret ) );
+			goto exit;
+		}
+
+		worker->started = 1;
+	}
+
+	// Every job may still need a slot to be reported in
+	if ( worker->num_jobs + worker->busy + worker->num_done >= XHD_PLUGINS_QUEUE_SIZE )
+	{
+		fprintf( stderr, "Plugin queue full, dropped %s\n", cmd->line );
+		ret = -EAGAIN;
+		goto exit;
+	}
+
+	xhd_plugin_job_t* job = &worker->jobs[ ( worker->head + worker->num_jobs ) % XHD_PLUGINS_QUEUE_SIZE ];
+
+	job->cmd    = cmd;
+	job->action = action;
+	job->step   = step;
+	job->ret    = 0;
+	worker->num_jobs++;
+	worker->num_queued++;
+
+	if ( action != NULL )
+		action->running++;
+
+	pthread_cond_signal( &worker->wake );
+
+	exit:
+		pthread_mutex_unlock( &worker->lock );
+		return ret;
+}
+
+/**
+ * XHD Plugins Dispatch Function
+ *
+ * The builtin of every "@plugin:handler" command
+ */
+int xhd_plugins_dispatch ( struct xhd_modelist_t* modelist, const xhd_command_t* cmd )
+{
+	if ( xhd_plugins_threaded( cmd ) )
+		return xhd_plugins_queue( cmd, NULL, 0 );
+
+	int ret = cmd->handler->run( cmd->state, cmd->cookie );
+
+	if ( ret )
+		fprintf( stderr, "%s failed: %d\n", cmd->line, ret );
+
+	return ret;
+}
+
+/**
+ * XHD Plugins Resolve Function
+ *
+ * Points a command written as "@plugin:handler [arg]" at its handler,
+ * name is the len characters after the @
+ */
+int xhd_plugins_resolve ( xhd_command_t* cmd, const char* name, size_t len )
+{
+	const char*                 colon = (const char*) memchr( name, ':', len );
+	const char*                 arg   = name + len + strspn( name + len, " \t" );
+	const xhd_plugin_handler_t* handler;
+	xhd_plugin_slot_t*          slot  = xhd_plugins_open( name, colon - name );
+
+	if ( slot == NULL )
+		return -EINVAL;
+
+	size_t handler_len = len - ( colon - name ) - 1;
+
+	for ( handler = slot->plugin->handlers; handler != NULL && handler->name != NULL; ++handler )
+	{
+		if ( strlen( handler->name ) == handler_len && strncmp( handler->name, colon + 1, handler_len ) == 0 )
+			break;
+	}
+
+	if ( handler == NULL || handler->name == NULL || handler->run == NULL )
+	{
+		fprintf( stderr, "Plugin %s has no handler %.*s\n", slot->name, (int) handler_len, colon + 1 );
+		return -EINVAL;
+	}
+
+	cmd->cookie = (void*) arg;
+
+	if ( handler->prepare != NULL && handler->prepare( slot->state, arg, &cmd->cookie ) )
+	{
+		fprintf( stderr, "Plugin handler @%.*s rejected its argument: %s\n", (int) len, name, arg );
+		return -EINVAL;
+	}
+
+	cmd->builtin = xhd_plugins_dispatch;
+	cmd->arg     = arg;
+	cmd->handler = handler;
+	cmd->state   = slot->state;
+	return 0;
+}
+
+/**
+ * XHD Plugins Drain Function
+ *
+ * Waits until the worker thread ran every queued handler
+ */
+void xhd_plugins_drain ( void )
+{
+	xhd_plugin_worker_t* worker = &xhd_plugins_worker;
+
+	pthread_mutex_lock( &worker->lock );
+
+	while ( worker->num_jobs != 0 || worker->busy )
+		pthread_cond_wait( &worker->idle, &worker->lock );
+
+	pthread_mutex_unlock( &worker->lock );
+}
+
+/**
+ * XHD Plugins Release Commands Function
+ *
+ * Releases the arguments handlers prepared for a config's commands
+ */
+static
+void xhd_plugins_release_commands ( xhd_command_t** commands, uint32_t alloc_commands )
+{
+	uint32_t i;
+
+	for ( i = 0; i < alloc_commands; ++i )
+	{
+		const xhd_command_t* cmd = commands[i];
+
+		if ( cmd != NULL && cmd->handler != NULL && cmd->handler->release != NULL )
+			cmd->handler->release( cmd->state, cmd->cookie );
+	}
+}
+
+/**
+ * XHD Plugins Free Retired Function
+ *
+ * Releases the retired configs no job is left for
+ */
+static
+void xhd_plugins_free_retired ( void )
+{
+	xhd_plugin_worker_t*   worker = &xhd_plugins_worker;
+	xhd_plugin_retired_t** link   = &xhd_plugins_retired;
+
+	pthread_mutex_lock( &worker->lock );
+	uint64_t finished = worker->num_finished;
+	pthread_mutex_unlock( &worker->lock );
+
+	while ( *link != NULL )
+	{
+		xhd_plugin_retired_t* retired = *link;
+
+		if ( retired->after > finished )
+		{
+			link = &retired->next;
+			continue;
+		}
+
+		*link = retired->next;
+		xhd_plugins_release_commands( retired->commands, retired->alloc_commands );
+		xhd_arena_release( &retired->arena );
+		free( retired );
+	}
+}
+
+/**
+ * XHD Plugins Receive Function
+ *
+ * Hands every finished job of an action to done, once it no longer counts as running,
+ * then frees the retired configs the worker thread is done with, from the event loop
+ */
+void xhd_plugins_receive ( void (*done)( xhd_action_t* action, uint32_t step, int ret, void* data ), void* data )
+{
+	uint64_t             count;
+	xhd_plugin_job_t     job;
+	xhd_plugin_worker_t* worker = &xhd_plugins_worker;
+
+	while ( read( xhd_plugins_fd, &count, sizeof(count) ) < 0 && errno == EINTR );
+
+	pthread_mutex_lock( &worker->lock );
+
+	while ( worker->num_done != 0 )
+	{
+		job = worker->done[ worker->done_head ];
+		worker->done_head = ( worker->done_head + 1 ) % XHD_PLUGINS_QUEUE_SIZE;
+		worker->num_done--;
+
+		// done may queue the next command
+		pthread_mutex_unlock( &worker->lock );
+
+		if ( job.action != NULL )
+		{
+			job.action->running--;
+			done( job.action, job.step, job.ret, data );
+		}
+
+		pthread_mutex_lock( &worker->lock );
+	}
+
+	pthread_mutex_unlock( &worker->lock );
+
+	xhd_plugins_free_retired();
+}
+
+/**
+ * XHD Plugins Detach Function
+ *
+ * Forgets which actions the queued and finished jobs belong to,
+ * before the config that holds those actions is freed
+ */
+void xhd_plugins_detach ( void )
+{
+	uint32_t             i;
+	xhd_plugin_worker_t* worker = &xhd_plugins_worker;
+
+	pthread_mutex_lock( &worker->lock );
+
+	for ( i = 0; i < XHD_PLUGINS_QUEUE_SIZE; ++i )
+	{
+		worker->jobs[i].action = NULL;
+		worker->done[i].action = NULL;
+	}
+
+	worker->current.action = NULL;
+	pthread_mutex_unlock( &worker->lock );
+}
+
+/**
+ * XHD Plugins Release Function
+ *
+ * Releases the arguments handlers prepared for a modelist's commands.
+ * While queued jobs may still run them, the modelist's arena is taken over
+ * instead and freed once they finished, so the event loop never waits
+ */
+void xhd_plugins_release ( xhd_modelist_t* modelist )
+{
+	xhd_plugin_worker_t*  worker = &xhd_plugins_worker;
+	xhd_plugin_retired_t* retired;
+
+	pthread_mutex_lock( &worker->lock );
+	uint64_t queued  = worker->num_queued;
+	int      pending = worker->num_finished != queued;
+	pthread_mutex_unlock( &worker->lock );
+
+	if ( ! pending )
+	{
+		xhd_plugins_release_commands( modelist->commands, modelist->alloc_commands );
+		return;
+	}
+
+	retired = (xhd_plugin_retired_t*) malloc( sizeof(xhd_plugin_retired_t) );
+
+	// Without memory to keep it, waiting is all that is left
+	if ( retired == NULL )
+	{
+		xhd_plugins_drain();
+		xhd_plugins_release_commands( modelist->commands, modelist->alloc_commands );
+		return;
+	}
+
+	retired->arena          = modelist->arena;
+	retired->commands       = modelist->commands;
+	retired->alloc_commands = modelist->alloc_commands;
+	retired->after          = queued;
+	retired->next           = xhd_plugins_retired;
+	xhd_plugins_retired     = retired;
+
+	xhd_arena_init( &modelist->arena );
+}
+
+/**
+ * XHD Plugins Unload Function
+ *
+ * Stops the worker thread and unloads every plugin,
+ * after every modelist using them was released
+ */
+void xhd_plugins_unload ( void )
+{
+	uint32_t             i;
+	xhd_plugin_worker_t* worker = &xhd_plugins_worker;
+
+	if ( worker->started )
+	{
+		pthread_mutex_lock( &worker->lock );
+		worker->stopping = 1;
+		pthread_cond_signal( &worker->wake );
+		pthread_mutex_unlock( &worker->lock );
+
+		pthread_join( worker->thread, NULL );
+		worker->started  = 0;
+		worker->stopping = 0;
+	}
+
+	// The worker ran every queued job before it stopped
+	xhd_plugins_free_retired();
+
+	for ( i = 0; i < xhd_plugins_num; ++i )
+	{
+		if ( xhd_plugins[i].plugin->fini != NULL )
+			xhd_plugins[i].plugin->fini( xhd_plugins[i].state );
+
+		dlclose( xhd_plugins[i].handle );
+		free( xhd_plugins[i].name );
+	}
+
+	free( xhd_plugins );
+	xhd_plugins       = NULL;
+	xhd_plugins_num   = 0;
+	xhd_plugins_alloc = 0;
+
+	if ( xhd_plugins_fd >= 0 )
+	{
+		close( xhd_plugins_fd );
+		xhd_plugins_fd = -1;
+	}
+}
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef XHD_PROCS_LIB_H
+#define XHD_PROCS_LIB_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+
+#include "xhd_types.h"
+
+#define XHD_MAX_CHILDREN 256	// Running children tracked at once
+#define XHD_PROC_HISTORY 256	// Finished children remembered
+#define XHD_PROC_LINELEN 64		// Command text kept per child
+#define XHD_PROC_NAMELEN 32		// Action name kept per child
+
+/**
+ * An XHD Child
+ *
+ * A running command. Local children are matched by pid;
+ * children of the executor have no local pid and are matched by tag.
+ */
+typedef struct xhd_child_t
+{
+	pid_t    pid;						// Process id, 0 if unknown
+	uint32_t tag;						// Unique spawn tag, 0 for a free slot
+	uint64_t start_ns;					// Monotonic spawn time
+	char     line[ XHD_PROC_LINELEN ];	// Start of the command line
+	char     name[ XHD_PROC_NAMELEN ];	// The --name of its action, empty if none
+
+	xhd_action_t* action;				// The action it runs for, NULL once detached
+	uint32_t      step;					// The index of its command in the action
+
+} xhd_child_t;
+
+/**
+ * An XHD Process Record
+ *
+ * The accounting of a finished command.
+ */
+typedef struct xhd_procrecord_t
+{
+	pid_t         pid;						// Process id
+	uint32_t      tag;						// Spawn tag
+	int           status;					// Wait status
+	uint64_t      wall_ns;					// Time from spawn to reap
+	struct rusage usage;					// Resources used
+	char          line[ XHD_PROC_LINELEN ];	// Start of the command line
+	char          name[ XHD_PROC_NAMELEN ];	// The --name of its action, empty if none
+
+} xhd_procrecord_t;
+
+xhd_child_t      xhd_procs_children[ XHD_MAX_CHILDREN ];
+xhd_procrecord_t xhd_procs_history[ XHD_PROC_HISTORY ];
+uint32_t         xhd_procs_num_history = 0;	// Records ever made, the ring wraps
+uint32_t         xhd_procs_next_tag    = 1;
+
+static inline
+uint64_t xhd_procs_now_ns ( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * XHD Procs Signalfd Function
+ *
+ * Blocks the given signals and returns a signalfd delivering them
+ * SIGCHLD is always included
+ */
+int xhd_procs_signalfd ( sigset_t* mask )
+{
+	sigaddset( mask, SIGCHLD );
+
+	if ( sigprocmask( SIG_BLOCK, mask, NULL ) )
+	{
+		fprintf( stderr, "Failed to block signals: %s\n", strerror( errno ) );
+		return -1;
+	}
+
+	int fd = signalfd( -1, mask, SFD_NONBLOCK | SFD_CLOEXEC );
+
+	if ( fd < 0 )
+		fprintf( stderr, "Failed to create signalfd: %s\n", strerror( errno ) );
+
+	return fd;
+}
+
+/**
+ * XHD Procs Track Function
+ *
+ * Remembers a running child; children beyond the table are still reaped
+ * A zero tag allocates a new one. Returns the child's tag, 0 if the table is full
+ * The child counts as running for action until it is taken
+ */
+uint32_t xhd_procs_track ( pid_t pid, uint32_t tag, const char* line, uint64_t start_ns, xhd_action_t* action, uint32_t step )
+{
+	uint32_t i;
+
+	if ( tag == 0 )
+	{
+		tag = xhd_procs_next_tag++;
+
+		if ( xhd_procs_next_tag == 0 )
+			xhd_procs_next_tag = 1;
+	}
+
+	for ( i = 0; i < XHD_MAX_CHILDREN; ++i )
+	{
+		xhd_child_t* child = &xhd_procs_children[i];
+
+		if ( child->tag != 0 )
+			continue;
+
+		child->pid      = pid;
+		child->tag      = tag;
+		child->start_ns = start_ns;
+		child->action   = action;
+		child->step     = step;
+		snprintf( child->line, sizeof(child->line), "%s", line ? line : "" );
+		snprintf( child->name, sizeof(child->name), "%s", action && action->name ? action->name : "" );
+
+		if ( action != NULL )
+			action->running++;
+
+		return tag;
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Procs Full Function
+ *
+ * Whether another child can be tracked
+ */
+int xhd_procs_full ( void )
+{
+	uint32_t i;
+
+	for ( i = 0; i < XHD_MAX_CHILDREN; ++i )
+	{
+		if ( xhd_procs_children[i].tag == 0 )
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * XHD Procs Take Function
+ *
+ * Removes a child from the table by pid, or by tag when pid is 0
+ * Returns 0 and fills child if it was tracked
+ */
+int xhd_procs_take ( pid_t pid, uint32_t tag, xhd_child_t* child )
+{
+	uint32_t i;
+
+	for ( i = 0; i < XHD_MAX_CHILDREN; ++i )
+	{
+		xhd_child_t* entry = &xhd_procs_children[i];
+
+		if ( entry->tag == 0 || ( pid != 0 ? entry->pid != pid : entry->tag != tag ) )
+			continue;
+
+		if ( entry->action != NULL )
+			entry->action->running--;
+
+		*child        = *entry;
+		entry->tag    = 0;
+		entry->pid    = 0;
+		entry->action = NULL;
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * XHD Procs Detach Function
+ *
+ * Forgets which actions the running children belong to,
+ * before the config that holds those actions is freed
+ */
+void xhd_procs_detach ( void )
+{
+	uint32_t i;
+
+	for ( i = 0; i < XHD_MAX_CHILDREN; ++i )
+		xhd_procs_children[i].action = NULL;
+}
+
+/**
+ * XHD Procs Record Function
+ *
+ * Adds a finished child to the history ring
+ */
+void xhd_procs_record ( xhd_procrecord_t* record )
+{
+	xhd_procs_history[ xhd_procs_num_history++ % XHD_PROC_HISTORY ] = *record;
+
+	if ( WIFEXITED( record->status ) && WEXITSTATUS( record->status ) != 0 )
+		fprintf( stderr, "Command failed with status %d: %s\n", WEXITSTATUS( record->status ), record->line );
+	else if ( WIFSIGNALED( record->status ) )
+		fprintf( stderr, "Command killed by signal %d: %s\n", WTERMSIG( record->status ), record->line );
+}
+
+/**
+ * XHD Procs Reap Function
+ *
+ * Reaps every finished child and passes its accounting to done,
+ * along with what was tracked of it, or NULL, and data
+ */
+int xhd_procs_reap ( void (*done)( xhd_procrecord_t* record, const xhd_child_t* child, void* data ), void* data )
+{
+	int           status;
+	struct rusage usage;
+	pid_t         pid;
+	uint64_t      now = xhd_procs_now_ns();
+
+	while ( ( pid = wait4( -1, &status, WNOHANG, &usage ) ) > 0 )
+	{
+		xhd_child_t      child;
+		xhd_procrecord_t record;
+
+		memset( &record, 0, sizeof(record) );
+		record.pid    = pid;
+		record.status = status;
+		record.usage  = usage;
+
+		int tracked = xhd_procs_take( pid, 0, &child ) == 0;
+
+		if ( tracked )
+		{
+			record.tag     = child.tag;
+			record.wall_ns = now - child.start_ns;
+			memcpy( record.line, child.line, sizeof(record.line) );
+			memcpy( record.name, child.name, sizeof(record.name) );
+		}
+
+		done( &record, tracked ? &child : NULL, data );
+	}
+
+	return 0;
+}
+
+/**
+ * XHD Procs Drain Function
+ *
+ * Empties a signalfd, returning the mask of signal numbers read
+ */
+uint64_t xhd_procs_drain ( int fd )
+{
+	struct signalfd_siginfo info;
+	uint64_t signals = 0;
+
+	while ( read( fd, &info, sizeof(info) ) == sizeof(info) )
+	{
+		if ( info.ssi_signo < 64 )
+			signals |= 1ull << info.ssi_signo;
+	}
+
+	return signals;
+}
+
+/**
+ * XHD Procs Dump Function
+ *
+ * Prints the finished command history, oldest first
+ */
+void xhd_procs_dump ( FILE* out )
+{
+	uint32_t i;
+	uint32_t first = xhd_procs_num_history > XHD_PROC_HISTORY ? xhd_procs_num_history - XHD_PROC_HISTORY : 0;
+
+	fprintf( out, "%-8s %-6s %10s %10s %10s %8s  %-16s %s\n", "pid", "status", "wall_ms", "user_ms", "sys_ms", "maxrss", "action", "command" );
+
+	for ( i = first; i < xhd_procs_num_history; ++i )
+	{
+		const xhd_procrecord_t* r = &xhd_procs_history[ i % XHD_PROC_HISTORY ];
+
+		fprintf( out, "%-8d %-6d %10.3f %10.3f %10.3f %8ld  %-16s %s\n",
+		         r->pid,
+		         WIFEXITED( r->status ) ? WEXITSTATUS( r->status ) : -WTERMSIG( r->status ),
+		         r->wall_ns / 1e6,
+		         r->usage.ru_utime.tv_sec * 1e3 + r->usage.ru_utime.tv_usec / 1e3,
+		         r->usage.ru_stime.tv_sec * 1e3 + r->usage.ru_stime.tv_usec / 1e3,
+		         r->usage.ru_maxrss,
+		         r->name[0] ? r->name : "-",
+		         r->line );
+	}
+}
+
+#endif
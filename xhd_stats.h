@@ -0,0 +1,256 @@
+#ifndef XHD_STATS_LIB_H
+#define XHD_STATS_LIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xhd_types.h"
+#include "xhd_arena.h"
+#include "xhd_procs.h"
+
+/**
+ * Key press latency, for every action together
+ * Survives reloads, unlike the timings kept in actions
+ */
+xhd_latency_t xhd_stats_global;
+
+/**
+ * The smallest difference seen between local time and X server time.
+ * X timestamps are server milliseconds from an unknown origin, so delays
+ * are measured against the fastest press seen so far.
+ */
+uint32_t xhd_stats_baseline       = 0;
+int      xhd_stats_have_baseline  = 0;
+uint32_t xhd_stats_dumps          = 0;
+
+/**
+ * XHD Stats Bucket Function
+ *
+ * Maps a value to its histogram bucket
+ */
+static inline
+uint32_t xhd_stats_bucket ( uint64_t value )
+{
+	if ( value < XHD_HIST_SUB_BUCKETS )
+		return (uint32_t) value;
+
+	uint32_t exp = 63 - __builtin_clzll( value );
+
+	if ( exp >= XHD_HIST_MAX_BITS )
+		return XHD_HIST_BUCKETS - 1;
+
+	uint32_t row = exp - XHD_HIST_SUB_BITS + 1;
+	uint32_t sub = ( value >> ( exp - XHD_HIST_SUB_BITS ) ) & ( XHD_HIST_SUB_BUCKETS - 1 );
+
+	return row * XHD_HIST_SUB_BUCKETS + sub;
+}
+
+/**
+ * XHD Stats Bucket Value Function
+ *
+ * Returns the middle of a bucket
+ */
+static inline
+uint64_t xhd_stats_bucket_value ( uint32_t index )
+{
+	uint32_t row = index / XHD_HIST_SUB_BUCKETS;
+	uint32_t sub = index % XHD_HIST_SUB_BUCKETS;
+
+	if ( row == 0 )
+		return sub;
+
+	uint32_t shift = row - 1;
+	uint64_t low   = (uint64_t) ( XHD_HIST_SUB_BUCKETS + sub ) << shift;
+
+	return low + ( ( 1ull << shift ) >> 1 );
+}
+
+/**
+ * XHD Stats Record Function
+ *
+ * Adds a value, in nanoseconds, to a histogram
+ */
+static inline
+void xhd_stats_record ( xhd_hist_t* hist, uint64_t value )
+{
+	if ( hist->count == 0 || value < hist->min )
+		hist->min = value;
+
+	if ( value > hist->max )
+		hist->max = value;
+
+	hist->count++;
+	hist->buckets[ xhd_stats_bucket( value ) ]++;
+}
+
+/**
+ * XHD Stats Quantile Function
+ *
+ * Returns the value below which a fraction q of the recorded values fall
+ */
+uint64_t xhd_stats_quantile ( const xhd_hist_t* hist, double q )
+{
+	uint32_t i;
+	uint64_t seen   = 0;
+	uint64_t target = (uint64_t) ( q * hist->count + 0.5 );
+
+	if ( hist->count == 0 )
+		return 0;
+
+	if ( target == 0 )
+		target = 1;
+
+	for ( i = 0; i < XHD_HIST_BUCKETS; ++i )
+	{
+		seen += hist->buckets[i];
+
+		if ( seen >= target )
+		{
+			uint64_t value = xhd_stats_bucket_value( i );
+
+			// The exact extremes are known, stay within them
+			if ( value < hist->min )
+				return hist->min;
+
+			return value > hist->max ? hist->max : value;
+		}
+	}
+
+	return hist->max;
+}
+
+/**
+ * XHD Stats Delay Function
+ *
+ * Returns how much longer than the fastest event seen so far
+ * an event took from its X server timestamp to now, in nanoseconds
+ */
+uint64_t xhd_stats_delay ( uint32_t server_ms, uint64_t now_ns )
+{
+	// Both clocks wrap the same way in 32 bits, so the difference stays meaningful
+	uint32_t offset = (uint32_t) ( now_ns / 1000000 ) - server_ms;
+
+	if ( ! xhd_stats_have_baseline || (int32_t) ( offset - xhd_stats_baseline ) < 0 )
+	{
+		xhd_stats_baseline      = offset;
+		xhd_stats_have_baseline = 1;
+	}
+
+	return (uint64_t) ( offset - xhd_stats_baseline ) * 1000000;
+}
+
+/**
+ * XHD Stats Action Function
+ *
+ * Returns the timings of an action, allocating them on first use
+ * They live in the arena of the modelist holding the action
+ */
+xhd_latency_t* xhd_stats_action ( xhd_arena_t* arena, xhd_action_t* action )
+{
+	if ( action->latency == NULL )
+		action->latency = (xhd_latency_t*) xhd_arena_alloc( arena, sizeof(xhd_latency_t) );
+
+	return action->latency;
+}
+
+/**
+ * XHD Stats Account Function
+ *
+ * Adds a finished command of an action to its accounting
+ */
+void xhd_stats_account ( xhd_latency_t* latency, const xhd_procrecord_t* record )
+{
+	const struct rusage* usage = &record->usage;
+
+	latency->runs++;
+	latency->wall_ns += record->wall_ns;
+	latency->cpu_ns  += ( usage->ru_utime.tv_sec + usage->ru_stime.tv_sec ) * 1000000000ull
+	                  + ( usage->ru_utime.tv_usec + usage->ru_stime.tv_usec ) * 1000ull;
+
+	if ( ! WIFEXITED( record->status ) || WEXITSTATUS( record->status ) != 0 )
+		latency->failures++;
+}
+
+/**
+ * XHD Stats Print Function
+ *
+ * Prints one histogram as a row of quantiles in microseconds
+ */
+void xhd_stats_print ( FILE* out, const char* name, const xhd_hist_t* hist )
+{
+	fprintf( out, "  %-8s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	         name, (unsigned long long) hist->count,
+	         hist->min / 1e3,
+	         xhd_stats_quantile( hist, 0.50 ) / 1e3,
+	         xhd_stats_quantile( hist, 0.90 ) / 1e3,
+	         xhd_stats_quantile( hist, 0.99 ) / 1e3,
+	         xhd_stats_quantile( hist, 0.999 ) / 1e3,
+	         hist->max / 1e3 );
+}
+
+void xhd_stats_print_latency ( FILE* out, const xhd_latency_t* latency )
+{
+	fprintf( out, "  %-8s %10s %9s %9s %9s %9s %9s %9s\n", "usec", "count", "min", "p50", "p90", "p99", "p99.9", "max" );
+	xhd_stats_print( out, "delay",  &latency->delay );
+	xhd_stats_print( out, "lookup", &latency->lookup );
+	xhd_stats_print( out, "spawn",  &latency->spawn );
+	xhd_stats_print( out, "total",  &latency->total );
+}
+
+/**
+ * XHD Stats Dump Function
+ *
+ * Prints the global key press latency, then that of every action run
+ * since the config was loaded, with the accounting of its commands
+ */
+void xhd_stats_dump ( FILE* out, const xhd_modelist_t* modelist )
+{
+	uint32_t i, j, k;
+
+	xhd_stats_dumps++;
+
+	fprintf( out, "Key press latency, all actions:\n" );
+	xhd_stats_print_latency( out, &xhd_stats_global );
+
+	for ( i = 0; i < modelist->num_modes; ++i )
+	{
+		const xhd_mode_t* mode = &modelist->modes[i];
+
+		for ( j = 0; j < XHD_NUM_KEYS; ++j )
+		{
+			const xhd_key_t* key = &mode->keymap.keys[j];
+
+			for ( k = 0; k < key->num_acts; ++k )
+			{
+				xhd_action_t* action = key->acts[k];
+
+				// Shared actions are printed once
+				if ( action->latency == NULL || action->latency->dumped == xhd_stats_dumps )
+					continue;
+
+				action->latency->dumped = xhd_stats_dumps;
+
+				if ( action->name != NULL )
+					fprintf( out, "Mode %s, action --name %s:\n", mode->name, action->name );
+				else if ( action->num_cmds != 0 )
+					fprintf( out, "Mode %s, action %s%s:\n", mode->name, action->cmds[0]->line, action->num_cmds > 1 ? " ..." : "" );
+				else
+					fprintf( out, "Mode %s, action --mode %s:\n", mode->name, action->next_name ? action->next_name : "" );
+
+				xhd_stats_print_latency( out, action->latency );
+
+				if ( action->latency->runs != 0 )
+				{
+					fprintf( out, "  commands %u finished, %u failed, %.3f ms wall, %.3f ms cpu\n",
+					         action->latency->runs, action->latency->failures,
+					         action->latency->wall_ns / 1e6, action->latency->cpu_ns / 1e6 );
+				}
+			}
+		}
+	}
+
+	fflush( out );
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef XHD_TYPES_LIB_H
 #define XHD_TYPES_LIB_H
 
+#include "xhd_plugin.h"
+
 #define GRAB_LIST_SIZE 100
 #define MODE_LIST_SIZE 1
 
@@ -8,56 +10,269 @@ typedef uint16_t xhd_modifier_t;
 typedef uint16_t xhd_keycode_t;
 typedef uint8_t  xhd_group_t;
 
+/**
+ * An XHD Arena Chunk
+ *
+ * One block of an arena, filled front to back.
+ */
+typedef struct xhd_arena_chunk_t
+{
+	struct xhd_arena_chunk_t* next;	// The next chunk
+	size_t size;					// The usable size of data
+	size_t used;					// The bytes handed out so far
+	char   data[];					// The memory
+
+} xhd_arena_chunk_t;
+
+/**
+ * An XHD Arena
+ *
+ * A bump allocator for everything loaded from a config.
+ * Nothing is freed on its own; the whole arena is released at once.
+ */
+typedef struct xhd_arena_t
+{
+	xhd_arena_chunk_t* chunks;		// The chunks, the current one first
+	size_t             size;		// The total size of all chunks
+
+} xhd_arena_t;
+
+/**
+ * An XHD Histogram
+ *
+ * A log-linear histogram of nanosecond values, in the style of HDR histograms:
+ * every power of two is split into XHD_HIST_SUB_BUCKETS equal buckets,
+ * so any value is known to within 1 / XHD_HIST_SUB_BUCKETS.
+ * Recording is a few instructions and never allocates.
+ */
+#define XHD_HIST_SUB_BITS    4
+#define XHD_HIST_SUB_BUCKETS ( 1 << XHD_HIST_SUB_BITS )
+#define XHD_HIST_MAX_BITS    40		// Values from 2^40 ns (about 18 minutes) are clamped
+#define XHD_HIST_BUCKETS     ( ( XHD_HIST_MAX_BITS - XHD_HIST_SUB_BITS + 1 ) * XHD_HIST_SUB_BUCKETS )
+
+typedef struct xhd_hist_t
+{
+	uint64_t count;						// The number of values recorded
+	uint64_t min;						// The smallest value
+	uint64_t max;						// The largest value
+	uint32_t buckets[ XHD_HIST_BUCKETS ];
+
+} xhd_hist_t;
+
+/**
+ * XHD Latency Statistics
+ *
+ * The stages of handling a key press, kept globally and for each action.
+ * Actions also add up the accounting of their finished commands.
+ */
+typedef struct xhd_latency_t
+{
+	xhd_hist_t delay;		// X server timestamp to local receive
+	xhd_hist_t lookup;		// Receive to action found
+	xhd_hist_t spawn;		// Launching one command
+	xhd_hist_t total;		// Receive to the last command launched
+	uint32_t   dumped;		// The last dump that printed this
+
+	uint32_t   runs;		// Commands of the action that finished
+	uint32_t   failures;	// Those that exited non-zero or were killed
+	uint64_t   wall_ns;		// Their wall time, summed
+	uint64_t   cpu_ns;		// Their user and system time, summed
+
+} xhd_latency_t;
+
+struct xhd_modelist_t;
+struct xhd_command_t;
+
+/**
+ * An XHD Builtin
+ *
+ * An operation of xhd itself, run in process by a "@name [arg]" command
+ */
+typedef int (*xhd_builtin_fn_t)( struct xhd_modelist_t* modelist, const struct xhd_command_t* cmd );
+
+typedef struct xhd_builtin_t
+{
+	const char*      name;		// The name after the @
+	xhd_builtin_fn_t fn;		// The operation
+	int              has_arg;	// Whether it takes an argument
+
+} xhd_builtin_t;
+
+/**
+ * An XHD Command Object
+ *
+ * A command line from the config, ready to be spawned.
+ * The argument vector is built once when the config is loaded.
+ * Builtins and plugin handlers are resolved then too, and are never spawned.
+ * Commands are interned, so every distinct line exists once per modelist.
+ */
+typedef struct xhd_command_t
+{
+	char*                       line;		// The command as written in the config
+	char**                      argv;		// The argument vector, NULL terminated
+	xhd_builtin_fn_t            builtin;	// The builtin it runs instead, or NULL
+	const char*                 arg;		// The argument of the builtin, within line
+	const xhd_plugin_handler_t* handler;	// The plugin handler of a "@plugin:handler" command, or NULL
+	void*                       state;		// The state of that plugin
+	void*                       cookie;		// The argument the handler prepared
+
+} xhd_command_t;
+
 /**
  * An XHD Action Object
  *
- * This represents a pairing between modifier flags and shell commands.
+ * This represents the shell commands run by a hotkey.
  * Each Key + Modifier combo can have one action
  * Each Action can have many commands
- * The Action Type is immutable
+ * Each Action can also switch the current mode
+ * Actions are shared by every key and group their hotkey maps to,
+ * so the modifier lives in the key's slots, not here.
+ * The Action Type is immutable once the config is loaded, except for its timings
+ * and the bookkeeping of its runs
  */
 typedef struct xhd_action_t
 {
-	xhd_modifier_t mod;			// Modifier flags
+	uint32_t        alloc_cmds;	// Number of command slots
+	uint32_t        num_cmds;	// Number of commands
+	xhd_command_t** cmds;		// List of interned commands
 
-	uint32_t       alloc_cmds;	// Number of command slots
-	uint32_t       num_cmds;	// Number of commands
-	char**         cmds;		// List of commands
+	uint32_t       next_mode;	// Mode to switch to, or XHD_NO_MODE
+	char*          next_name;	// Name of that mode, until it is resolved
+	char*          name;		// Name to run it by over the control socket, or NULL
+
+	uint8_t        exec;		// How the commands are run, see XHD_EXEC_PARALLEL
+	uint8_t        repeat;		// What auto-repeated presses do, see XHD_REPEAT_ALL
+	uint32_t       repeat_ms;	// Least time between repeated runs, 0 for no limit
+
+	xhd_latency_t* latency;		// Timings, allocated on the first press
+	uint32_t       last_run;	// X server time of the last run
+	uint32_t       running;		// The number of its commands still running
 
 } xhd_action_t;
 
+#define XHD_NO_MODE ( (uint32_t) -1 )
+
+// How the commands of an action are run
+#define XHD_EXEC_PARALLEL     0	// All at once
+#define XHD_EXEC_SERIAL       1	// One after another, until one fails
+#define XHD_EXEC_SINGLE_SHELL 2	// As one shell script, joined when the config is loaded
+
+// What a key held down long enough to auto-repeat does
+#define XHD_REPEAT_ALL      0	// Every repeat runs the action
+#define XHD_REPEAT_NONE     1	// Only the first press runs it
+#define XHD_REPEAT_COALESCE 2	// Repeats are merged into a run still in progress
+
+// The key events an action can be bound to
+#define XHD_EVENT_PRESS   0
+#define XHD_EVENT_RELEASE 1
+#define XHD_NUM_EVENTS    2
+
 /**
  * An XHD Key Object
  *
- * This object represents a pairing of a key symbol to actions.
- * Each key symbol can be assigned many actions (with different modifier flags).
+ * This object is the hot half of a keymap entry: only what a key press needs.
+ * Each key can be assigned many actions (with different modifier flags).
+ *
+ * Actions are found through slots, a table indexed by the modifier state.
+ * Presses and releases have separate tables sharing one list of actions.
+ * A zero slot means no action, otherwise it holds the action index plus one.
+ * Each table is only allocated once the key receives its first action for that event.
  *
  * The xhd_keymap_t is responsible for translating key press events to these.
  */
 typedef struct xhd_key_t
 {
-	xkb_keysym_t  symbol;		// The symbol assigned to this key
+	uint8_t*       slots[ XHD_NUM_EVENTS ];	// Modifier to action tables, XHD_NUM_MODIFIERS long
+	uint32_t       num_acts;				// The number of actions assigned to this key
+	xhd_action_t** acts;					// The array of shared actions
+
+} xhd_key_t;
+
+// Modifiers are the 8 core X modifier bits, so a slot table spans 256 states.
+#define XHD_NUM_MODIFIERS 256
 
-	uint32_t      num_acts;		// The number of actions assigned to this key
+/**
+ * An XHD Key Info Object
+ *
+ * This object is the cold half of a keymap entry.
+ * It is only touched while the config is loaded, never on a key press.
+ * The symbol on each key lives in the shared xhd_keysyms_t table.
+ */
+typedef struct xhd_keyinfo_t
+{
 	uint32_t      alloc_acts;	// The number of allocated action slots
-	xhd_action_t* acts;			// The array of actions
 
-} xhd_key_t;
+} xhd_keyinfo_t;
 
 /**
  * An XHD Key Map Object
  *
- * A hierarchically map:
+ * A flattened map, indexed with XHD_KEY_INDEX:
  * 1st level: X Group/Layout Level (0 - 3)
  * 2nd level: X keycodes (0 - 255)
  * 3rd level: X Shift Level (0, 1 only)
  *
  * This is responsible for translating key press events to xhd_key_t's.
+ * The hot and cold records live in a single allocation starting at keys.
  *
  * Only 2 shift levels supported for naive keysym translation,
  * for specifying actions on other levels see main documentation
  */
-typedef xhd_key_t*** xhd_keymap_t;
+typedef struct xhd_keymap_t
+{
+	xhd_key_t*     keys;		// Hot records
+	xhd_keyinfo_t* info;		// Cold records, same indexing as keys
+
+} xhd_keymap_t;
+
+#define XHD_NUM_KEYS ( MAX_GROUPS * MAX_KEYCODE * MAX_LEVELS )
+#define XHD_KEY_INDEX( group, keycode, level ) \
+	( ( (uint32_t) (group) * MAX_KEYCODE + (uint32_t) (keycode) ) * MAX_LEVELS + (uint32_t) (level) )
+#define XHD_KEY_GROUP( index )   ( (index) / ( MAX_KEYCODE * MAX_LEVELS ) )
+#define XHD_KEY_KEYCODE( index ) ( ( (index) / MAX_LEVELS ) % MAX_KEYCODE )
+#define XHD_KEY_LEVEL( index )   ( (index) % MAX_LEVELS )
+
+/**
+ * An XHD Symbol Index Entry
+ *
+ * Pairs a keysym with one keymap position that produces it.
+ */
+typedef struct xhd_symentry_t
+{
+	xkb_keysym_t symbol;		// The symbol
+	uint32_t     key_index;		// Where it lives, see XHD_KEY_INDEX
+
+} xhd_symentry_t;
+
+/**
+ * An XHD Symbol Index
+ *
+ * The inverse of the keymap symbols: entries are sorted by symbol,
+ * then by key index, so all positions of a keysym are found with one
+ * binary search, in the same group, keycode, level order as the keymap.
+ */
+typedef struct xhd_symindex_t
+{
+	uint32_t        num_entries;	// The number of entries
+	xhd_symentry_t* entries;		// The sorted entries
+
+} xhd_symindex_t;
+
+/**
+ * An XHD Keysym Table
+ *
+ * The symbols of the X keyboard map, translated once and shared by all modes.
+ * The table is reference counted; each mode holds one reference and the
+ * current table holds another until the keyboard map changes.
+ */
+typedef struct xhd_keysyms_t
+{
+	uint32_t       refs;			// The number of references held
+	uint32_t       generation;		// The keyboard map generation it was built for
+	xhd_symindex_t index;			// The symbols, by symbol
+	xkb_keysym_t   symbols[ XHD_NUM_KEYS ];	// The symbols, see XHD_KEY_INDEX
+
+} xhd_keysyms_t;
 
 /**
  * An XHD Grab Object
@@ -79,10 +294,11 @@ typedef struct xhd_grab_t
  *
  * Grabbing key events from X passes no information about group/layout.
  * So, we register for keyboard group/layout events.
- * On such an event, we ungrab all previously grabbed keys and then
- * grab all keys associated with the new group/layout.
+ * On such an event, we ungrab the keys only the old group/layout needs
+ * and grab the keys only the new group/layout needs.
  * To do this efficiently, we keep a list of all the necessary keys
  * that need to be grabbed, aka, the grablist.
+ * The list is kept sorted by keycode then modifier, without duplicates.
  */
 typedef struct xhd_grablist_t
 {
@@ -99,18 +315,60 @@ typedef struct xhd_grablist_t
  */
 typedef xhd_grablist_t* xhd_grabmap_t;
 
+/**
+ * An XHD Grab Difference
+ *
+ * The requests that turn one grablist into another.
+ * Grabs present in both lists are left alone, so they never drop out.
+ */
+typedef struct xhd_grabdiff_t
+{
+	xhd_grablist_t ungrabs;		// Grabs only in the old list
+	xhd_grablist_t grabs;		// Grabs only in the new list
+
+} xhd_grabdiff_t;
+
+#define XHD_DELTA_INDEX( from, to ) ( (uint32_t) (from) * MAX_GROUPS + (uint32_t) (to) )
+#define XHD_SWITCH_INDEX( mode, group ) ( (uint32_t) (mode) * MAX_GROUPS + (uint32_t) (group) )
+
+/**
+ * XHD Grab Statistics
+ *
+ * Describes the last batch of grab requests sent to the X server.
+ */
+typedef struct xhd_grabstats_t
+{
+	uint32_t num_grabs;		// The number of grabs requested
+	uint32_t num_ungrabs;	// The number of ungrabs requested
+	uint32_t num_failed;	// The number of grabs the X server refused
+	uint64_t elapsed_ns;	// Time from the first request to the last reply
+
+} xhd_grabstats_t;
+
 /**
  * An XHD Mode
  *
  * This represents the working state of XHD.
  * Each mode has a mapping from keycodes, group/layout, and modifiers to actions
  * Each mode has a mapping from group/layout to grabs
+ * Each mode has the grab differences to every mode its actions switch to,
+ * other entries of switches are left empty until a switch needs them
+ * Key sequences are compiled into modes too: each prefix is a mode of its own,
+ * reached from the mode of the shorter prefix and left again by its root
  */
 typedef struct xhd_mode_t
 {
 	char*         name;			// The name of this mode
+	uint32_t      root;			// The mode a key sequence started in, XHD_NO_MODE if not a prefix
 	xhd_grabmap_t grabs;		// The Grab Map
+	xhd_grabdiff_t* deltas;		// Group switches, see XHD_DELTA_INDEX
+	xhd_grabdiff_t* switches;	// Mode switches, see XHD_SWITCH_INDEX
+	uint32_t      num_switches;	// The number of modes switches covers
+	uint32_t      num_named;	// The number of named actions
+	uint32_t      alloc_named;	// The number of allocated named slots
+	xhd_action_t** named;		// The actions that can be run by name
 	xhd_keymap_t  keymap;		// The Key Map
+	xhd_keysyms_t* keysyms;		// The shared symbols of the Key Map
 	xhd_group_t   cur_group;	// Current Group/Layout
 
 } xhd_mode_t;
@@ -120,6 +378,8 @@ typedef struct xhd_mode_t
  *
  * Tracks all parsed modes and their key and grab tables
  * Allows for each mode switching
+ * Everything the modes point to lives in the arena,
+ * commands are deduplicated through an open addressing table
  */
 typedef struct xhd_modelist_t
 {
@@ -128,6 +388,11 @@ typedef struct xhd_modelist_t
 	uint32_t alloc_modes;	// The number of allocated mode slots
 	xhd_mode_t* modes;		// The list
 
+	xhd_arena_t     arena;			// Owns all config memory
+	uint32_t        num_commands;	// The number of interned commands
+	uint32_t        alloc_commands;	// The size of the table, a power of two
+	xhd_command_t** commands;		// The interned commands
+
 } xhd_modelist_t;
 
 #endif
\ No newline at end of file